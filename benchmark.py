@@ -0,0 +1,400 @@
+import sys
+import re
+import argparse
+import time
+import json
+import os
+import platform
+import subprocess
+import tempfile
+import threading
+import contextlib
+import cProfile
+import multiprocessing
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+# peak memory is read from the kernel accounting of each run, not available on every platform
+try:
+    import resource
+except ImportError:
+    resource = None
+
+# import openai module, pointed at the mock model server
+import openai
+
+import pleaseAddComment
+
+# input the synthetic files are generated from
+example_file = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'example', 'guminterceptor.c')
+
+# answer of the mock model to single-function, chunk and merge prompts
+mock_comment = "This function is part of the benchmark input, it does what its name says and returns the result to the caller."
+
+# number of characters of mock answer per streamed event
+mock_chunk_size = 4
+
+# metrics compared with a baseline, and whether a larger value is better
+compared_metrics = {
+    "discovery_seconds": False,
+    "wall_seconds": False,
+    "peak_rss_bytes": False,
+    "functions_per_second": True,
+    "tokens_per_second": True,
+}
+
+
+class MockModel:
+    """
+    Behaviour of the mock model server: latency of the answers and errors injected into the requests
+    """
+
+    def __init__(self, latency=0.05, token_latency=0.002, rate_limit_every=0, retry_after=0.1, error_every=0):
+        """
+        :param latency: Seconds before the first token of an answer
+        :param token_latency: Seconds between two streamed events of an answer
+        :param rate_limit_every: Answer every Nth request with a 429 error, 0 to disable
+        :param retry_after: Seconds given in the Retry-After header of the 429 errors
+        :param error_every: Answer every Nth request with a 500 error, 0 to disable
+        """
+        self.latency = latency
+        self.token_latency = token_latency
+        self.rate_limit_every = rate_limit_every
+        self.retry_after = retry_after
+        self.error_every = error_every
+        self.lock = threading.Lock()
+        self.reset()
+
+    def reset(self):
+        with self.lock:
+            self.requests = 0
+            self.rate_limited = 0
+            self.errors = 0
+
+    def next_status(self):
+        """
+        Count a request and decide how it is answered
+        :return: The HTTP status of the answer
+        """
+        with self.lock:
+            self.requests += 1
+            if self.rate_limit_every and self.requests % self.rate_limit_every == 0:
+                self.rate_limited += 1
+                return 429
+            if self.error_every and self.requests % self.error_every == 0:
+                self.errors += 1
+                return 500
+            return 200
+
+    @staticmethod
+    def answer(prompt):
+        """
+        Generate an answer in the format the prompt asks for
+        :param prompt: The prompt of the request
+        :return: The text of the answer
+        """
+        # batch prompts expect a JSON object keyed by the number of each function or type
+        count = len(re.findall(r'^(?:Function|Type) (\d+):$', prompt, re.MULTILINE))
+        if count:
+            return "\n" + json.dumps({str(i + 1): mock_comment for i in range(count)})
+        return "\n\n" + mock_comment
+
+    def to_dict(self):
+        with self.lock:
+            return {"requests": self.requests, "rate_limited": self.rate_limited, "errors": self.errors}
+
+
+class MockHandler(BaseHTTPRequestHandler):
+    """
+    Completions endpoint of the mock model server, answering like the OpenAI API
+    """
+
+    def log_message(self, format, *args):
+        pass
+
+    def _send_json(self, status, body, headers=()):
+        data = json.dumps(body).encode('utf-8')
+        self.send_response(status)
+        self.send_header('Content-Type', 'application/json')
+        self.send_header('Content-Length', str(len(data)))
+        for name, value in headers:
+            self.send_header(name, value)
+        self.end_headers()
+        self.wfile.write(data)
+
+    def do_POST(self):
+        model = self.server.model
+        request = json.loads(self.rfile.read(int(self.headers.get('Content-Length', 0))))
+        status = model.next_status()
+        if status == 429:
+            self._send_json(429, {"error": {"message": "Rate limit reached (mock)", "type": "requests", "code": None}},
+                            [('Retry-After', str(model.retry_after))])
+            return
+        if status != 200:
+            self._send_json(status, {"error": {"message": "Internal error (mock)", "type": "server_error", "code": None}})
+            return
+
+        time.sleep(model.latency)
+        # a list of prompts is a batch, answered in a single forward pass like a local inference server would
+        prompts = request.get("prompt", "")
+        prompts = prompts if isinstance(prompts, list) else [prompts]
+        texts = [MockModel.answer(prompt) for prompt in prompts]
+        if not request.get("stream"):
+            self._send_json(200, {
+                "object": "text_completion",
+                "model": request.get("model"),
+                "choices": [{"text": text, "index": i, "logprobs": None, "finish_reason": "stop"}
+                            for i, text in enumerate(texts)],
+                "usage": {"prompt_tokens": sum(pleaseAddComment.count_tokens(prompt) for prompt in prompts),
+                          "completion_tokens": sum(pleaseAddComment.count_tokens(text) for text in texts)},
+            })
+            return
+        text = texts[0]
+
+        # server-sent events, the end of the body is marked by closing the connection
+        self.send_response(200)
+        self.send_header('Content-Type', 'text/event-stream')
+        self.end_headers()
+        try:
+            for start in range(0, len(text), mock_chunk_size):
+                event = {"object": "text_completion", "model": request.get("model"),
+                         "choices": [{"text": text[start:start + mock_chunk_size], "index": 0, "logprobs": None,
+                                      "finish_reason": None}]}
+                self.wfile.write(b"data: " + json.dumps(event).encode('utf-8') + b"\n\n")
+                self.wfile.flush()
+                time.sleep(model.token_latency)
+            self.wfile.write(b"data: [DONE]\n\n")
+        except (BrokenPipeError, ConnectionResetError):
+            # the client cancelled the request
+            pass
+
+
+def start_mock_server(model):
+    """
+    Start the mock model server on a free local port
+    :param model: The behaviour of the server
+    :return: The server, serving from a background thread
+    """
+    server = ThreadingHTTPServer(('127.0.0.1', 0), MockHandler)
+    server.daemon_threads = True
+    server.model = model
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    return server
+
+
+def make_synthetic_file(path, scale):
+    """
+    Write an input made of copies of the example file, with the identifiers of each copy renamed
+    so that no two definitions are the same
+    :param path: Path to the file to write
+    :param scale: The number of copies
+    :return: The size of the file in bytes
+    """
+    with open(example_file, 'r') as f:
+        content = f.read()
+    with open(path, 'w') as f:
+        for copy in range(scale):
+            f.write(content if copy == 0 else re.sub(r'\bgum_', f'gum{copy}_', content))
+    return os.path.getsize(path)
+
+
+def peak_rss_bytes():
+    """
+    :return: The peak resident set size of the current process in bytes, or None if it can't be measured
+    """
+    if resource is None:
+        return None
+    peak = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    # Linux reports kilobytes, macOS bytes
+    return peak if sys.platform == 'darwin' else peak * 1024
+
+
+def run_scenario(scenario):
+    """
+    Run one scenario, in a fresh process so that its peak memory is its own
+    :param scenario: A dictionary describing the scenario, see main
+    :return: A dictionary with the measures of the scenario
+    """
+    openai.api_base = scenario["api_base"]
+    openai.api_key = "benchmark"
+
+    # discovery alone, the best of a few runs
+    pleaseAddComment._init_parse_worker()
+    timings = []
+    for _ in range(scenario["repeat"]):
+        started = time.perf_counter()
+        spans = pleaseAddComment.parse_file(scenario["input"])
+        timings.append(time.perf_counter() - started)
+    result = {
+        "name": scenario["name"],
+        "scale": scenario["scale"],
+        "input_bytes": scenario["input_bytes"],
+        "definitions": len(spans),
+        "discovery_seconds": min(timings),
+        "discovery_bytes_per_second": scenario["input_bytes"] / max(min(timings), 1e-9),
+    }
+    if scenario["discovery_only"]:
+        result["peak_rss_bytes"] = peak_rss_bytes()
+        return result
+
+    # end to end, through the command line of the tool
+    report_path = scenario["output"] + '.report.json'
+    sys.argv = ['pleaseAddComment.py', scenario["input"], scenario["output"], '--no_cache', '--report', report_path,
+                '--api_key', 'benchmark'] + scenario["arguments"]
+    if scenario["local"]:
+        sys.argv += ['--local_url', scenario["api_base"], '--local_model', 'mock']
+    if not scenario["dedup"]:
+        # the copies of the synthetic inputs only differ by their identifiers, they would share their comments
+        sys.argv.append('--no_dedup')
+    profiler = cProfile.Profile() if scenario["profile"] else None
+    started = time.perf_counter()
+    with open(os.devnull, 'w') as devnull, contextlib.redirect_stdout(devnull):
+        if profiler is not None:
+            profiler.enable()
+        try:
+            pleaseAddComment.main()
+        except SystemExit:
+            # failures are part of the report
+            pass
+        finally:
+            if profiler is not None:
+                profiler.disable()
+    wall = time.perf_counter() - started
+    if profiler is not None:
+        profiler.dump_stats(scenario["profile"])
+
+    with open(report_path, 'r') as f:
+        report = json.load(f)
+    tokens = report["tokens"]["prompt"] + report["tokens"]["completion"]
+    result.update({
+        "wall_seconds": wall,
+        "commented": report["commented"],
+        "functions_per_second": report["commented"] / wall,
+        "tokens": report["tokens"],
+        "tokens_per_second": tokens / wall,
+        "peak_rss_bytes": peak_rss_bytes(),
+        "stopped": report["stopped"],
+        "requests": report["requests"],
+        "local_batches": report.get("local_batches"),
+    })
+    return result
+
+
+def compare(results, baseline, tolerance):
+    """
+    Compare the results with the ones of a previous run
+    :param results: The results of this run
+    :param baseline: The results of the previous run
+    :param tolerance: The relative change allowed before a metric is reported as a regression
+    :return: A list of messages, one per regression
+    """
+    previous = {scenario["name"]: scenario for scenario in baseline["scenarios"]}
+    regressions = []
+    for scenario in results["scenarios"]:
+        old = previous.get(scenario["name"])
+        if old is None:
+            continue
+        for metric, larger_is_better in compared_metrics.items():
+            if not old.get(metric) or scenario.get(metric) is None:
+                continue
+            change = scenario[metric] / old[metric] - 1
+            if (-change if larger_is_better else change) > tolerance:
+                regressions.append(f"{scenario['name']}: {metric} {old[metric]:.4g} -> {scenario[metric]:.4g} ({change:+.0%})")
+    return regressions
+
+
+def git_revision():
+    with contextlib.suppress(OSError, subprocess.CalledProcessError):
+        return subprocess.run(['git', '-C', os.path.dirname(os.path.abspath(__file__)), 'rev-parse', 'HEAD'],
+                              check=True, capture_output=True, text=True).stdout.strip()
+    return None
+
+
+def main():
+    # parse command line arguments
+    parser = argparse.ArgumentParser(description='Benchmark the commenting pipeline against a mock model server')
+    parser.add_argument('--scales', default='1,10,100', help='Comma separated sizes of the inputs, in copies of example/guminterceptor.c')
+    parser.add_argument('--discovery_only', action='store_true', help='Only measure the discovery of the definitions')
+    parser.add_argument('--repeat', type=int, default=3, help='Number of discovery runs per input, the best one is kept')
+    parser.add_argument('--latency', type=float, default=0.05, help='Seconds before the mock server sends the first token')
+    parser.add_argument('--token_latency', type=float, default=0.002, help='Seconds between two streamed events of the mock server')
+    parser.add_argument('--rate_limit_every', type=int, default=0, help='Answer every Nth request with a 429 error (0 to disable)')
+    parser.add_argument('--retry_after', type=float, default=0.1, help='Seconds in the Retry-After header of the 429 errors')
+    parser.add_argument('--error_every', type=int, default=0, help='Answer every Nth request with a 500 error (0 to disable)')
+    parser.add_argument('--local', action='store_true', help='Use the mock server as a local server, with batched requests')
+    parser.add_argument('--dedup', action='store_true', help='Let the copies in the synthetic inputs share their comments, instead of sending them all')
+    parser.add_argument('--output', help='Write the results as JSON to this path, instead of the standard output')
+    parser.add_argument('--profile', help='Write the cProfile statistics of the main thread of each run to this directory')
+    parser.add_argument('--baseline', help='Results of a previous run to compare with, regressions make the benchmark fail')
+    parser.add_argument('--tolerance', type=float, default=0.2, help='Relative change of a metric reported as a regression')
+    args, arguments = parser.parse_known_args()
+    # the other arguments are given to pleaseAddComment.py, e.g. --concurrency 16 or --no_stream
+
+    model = MockModel(args.latency, args.token_latency, args.rate_limit_every, args.retry_after, args.error_every)
+    server = start_mock_server(model)
+    api_base = f"http://127.0.0.1:{server.server_address[1]}/v1"
+    if args.profile is not None:
+        os.makedirs(args.profile, exist_ok=True)
+
+    # every run gets a fresh process, the mock server stays in this one
+    context = multiprocessing.get_context('spawn')
+    scenarios = []
+    with tempfile.TemporaryDirectory() as directory:
+        for scale in (int(scale) for scale in args.scales.split(',')):
+            name = f"guminterceptor_x{scale}"
+            path = os.path.join(directory, name + '.c')
+            scenario = {
+                "name": name,
+                "scale": scale,
+                "input": path,
+                "input_bytes": make_synthetic_file(path, scale),
+                "output": os.path.join(directory, name + '_commented.c'),
+                "api_base": api_base,
+                "repeat": max(1, args.repeat),
+                "discovery_only": args.discovery_only,
+                "local": args.local,
+                "dedup": args.dedup,
+                "arguments": arguments,
+                "profile": None if args.profile is None else os.path.join(args.profile, name + '.prof'),
+            }
+            model.reset()
+            with context.Pool(1) as pool:
+                result = pool.apply(run_scenario, (scenario,))
+            result["server"] = model.to_dict()
+            scenarios.append(result)
+            print(f"{name}: {result['definitions']} definitions located in {result['discovery_seconds'] * 1000:.1f} ms"
+                  + ("" if args.discovery_only else
+                     f", {result['commented']} commented in {result['wall_seconds']:.2f} s"
+                     f" ({result['functions_per_second']:.1f} functions/s, {result['tokens_per_second']:.0f} tokens/s)"),
+                  file=sys.stderr)
+            os.remove(path)
+    server.shutdown()
+
+    results = {
+        "revision": git_revision(),
+        "python": platform.python_version(),
+        "platform": platform.platform(),
+        "cpus": os.cpu_count(),
+        "tiktoken": pleaseAddComment.tiktoken is not None,
+        "settings": {key: value for key, value in vars(args).items() if key not in ('output', 'baseline', 'profile')},
+        "arguments": arguments,
+        "scenarios": scenarios,
+    }
+    if args.output is not None:
+        with open(args.output, 'w') as f:
+            json.dump(results, f, indent=2)
+    else:
+        json.dump(results, sys.stdout, indent=2)
+        print()
+
+    # compare with a previous run
+    if args.baseline is not None:
+        with open(args.baseline, 'r') as f:
+            regressions = compare(results, json.load(f), args.tolerance)
+        for regression in regressions:
+            print(f"Regression: {regression}", file=sys.stderr)
+        if regressions:
+            sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
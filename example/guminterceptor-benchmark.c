@@ -0,0 +1,600 @@
+/*
+ * Microbenchmarks for the interceptor's hot paths: hooked calls, attach and
+ * detach, transaction commits and thread scaling. Results are written as
+ * JSON so runs can be compared against each other.
+ *
+ * Licence: wxWindows Library Licence, Version 3.1
+ */
+
+#include "gum.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GUM_BENCH_MANY_LISTENERS 8
+#define GUM_BENCH_MAX_PAGES 10000
+#define GUM_BENCH_TARGET_SIZE 32
+
+typedef struct _GumBenchOptions GumBenchOptions;
+typedef struct _GumBenchPages GumBenchPages;
+typedef struct _GumBenchStartLine GumBenchStartLine;
+typedef gint (* GumBenchTargetFunc) (gint value);
+
+struct _GumBenchOptions
+{
+  gint calls;
+  gint rounds;
+  gint attach_cycles;
+  gint max_threads;
+  gchar * output;
+};
+
+struct _GumBenchPages
+{
+  gpointer base;
+  guint n_pages;
+  guint page_size;
+};
+
+struct _GumBenchStartLine
+{
+  GMutex mutex;
+  GCond cond;
+  guint n_ready;
+  gboolean go;
+
+  guint n_calls;
+};
+
+static void gum_bench_invocations (GumInterceptor * interceptor,
+    const GumBenchOptions * options, GString * json);
+static gdouble gum_bench_measure_calls (GumInterceptor * interceptor,
+    GumInvocationListener ** listeners, guint n_listeners,
+    gboolean replace, const GumBenchOptions * options);
+static void gum_bench_attach_detach (GumInterceptor * interceptor,
+    const GumBenchOptions * options, GString * json);
+static void gum_bench_transactions (GumInterceptor * interceptor,
+    const GumBenchOptions * options, GString * json);
+static void gum_bench_threads (GumInterceptor * interceptor,
+    const GumBenchOptions * options, GString * json);
+static gpointer gum_bench_thread_run (gpointer data);
+
+static gboolean gum_bench_pages_init (GumBenchPages * self, guint n_pages);
+static void gum_bench_pages_destroy (GumBenchPages * self);
+static gpointer gum_bench_pages_get_target (GumBenchPages * self,
+    guint index);
+
+static void gum_bench_call_target (guint n_calls);
+static gint gum_bench_target_function (gint value);
+static gint gum_bench_replacement_function (gint value);
+static void gum_bench_on_hit (GumInvocationContext * ic, gpointer user_data);
+
+static gint gum_bench_compare_doubles (gconstpointer a, gconstpointer b);
+static gdouble gum_bench_median (gdouble * samples, guint n_samples);
+static void gum_bench_append_number (GString * json, const gchar * indent,
+    const gchar * name, gdouble value, gboolean last);
+
+static volatile gint gum_bench_sink;
+static GumBenchTargetFunc volatile gum_bench_target =
+    gum_bench_target_function;
+static GumBenchTargetFunc gum_bench_target_original;
+
+int
+main (int argc,
+      char * argv[])
+{
+  GumBenchOptions options = { 2000000, 5, 1000, 64, NULL };
+  GOptionEntry entries[] = {
+    { "calls", 'n', 0, G_OPTION_ARG_INT, &options.calls,
+      "Hooked calls per measurement", "N" },
+    { "rounds", 'r', 0, G_OPTION_ARG_INT, &options.rounds,
+      "Rounds per transaction size, the median is reported", "N" },
+    { "attach-cycles", 'a', 0, G_OPTION_ARG_INT, &options.attach_cycles,
+      "Attach/detach cycles to time", "N" },
+    { "max-threads", 't', 0, G_OPTION_ARG_INT, &options.max_threads,
+      "Largest thread count of the scaling run", "N" },
+    { "output", 'o', 0, G_OPTION_ARG_FILENAME, &options.output,
+      "Write the JSON results to FILE instead of stdout", "FILE" },
+    { NULL }
+  };
+  GOptionContext * context;
+  GError * error = NULL;
+  GumInterceptor * interceptor;
+  GString * json;
+  int result = 0;
+
+  context = g_option_context_new ("- benchmark the interceptor");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    goto invalid_argument;
+  if (options.calls <= 0 || options.rounds <= 0 ||
+      options.attach_cycles <= 0 || options.max_threads <= 0)
+  {
+    g_set_error (&error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+        "counts must be positive");
+    goto invalid_argument;
+  }
+
+  gum_init_embedded ();
+
+  interceptor = gum_interceptor_obtain ();
+
+  json = g_string_new ("{\n");
+  g_string_append_printf (json, "  \"calls\": %d,\n", options.calls);
+
+  gum_bench_invocations (interceptor, &options, json);
+  gum_bench_attach_detach (interceptor, &options, json);
+  gum_bench_transactions (interceptor, &options, json);
+  gum_bench_threads (interceptor, &options, json);
+
+  g_string_append (json, "}\n");
+
+  if (options.output != NULL)
+  {
+    if (!g_file_set_contents (options.output, json->str, json->len, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      g_error_free (error);
+      result = 1;
+    }
+  }
+  else
+  {
+    fputs (json->str, stdout);
+  }
+
+  g_string_free (json, TRUE);
+
+  g_object_unref (interceptor);
+
+  gum_deinit_embedded ();
+
+  goto beach;
+
+invalid_argument:
+  {
+    g_printerr ("%s\n", error->message);
+    g_error_free (error);
+    result = 1;
+    goto beach;
+  }
+beach:
+  {
+    g_option_context_free (context);
+    g_free (options.output);
+
+    return result;
+  }
+}
+
+/*
+ * Nanoseconds per call of a hooked function, for each listener and
+ * replacement combination the dispatch paths distinguish between.
+ */
+static void
+gum_bench_invocations (GumInterceptor * interceptor,
+                       const GumBenchOptions * options,
+                       GString * json)
+{
+  GumInvocationListener * enter[GUM_BENCH_MANY_LISTENERS];
+  GumInvocationListener * enter_leave[GUM_BENCH_MANY_LISTENERS];
+  guint i;
+
+  for (i = 0; i != GUM_BENCH_MANY_LISTENERS; i++)
+  {
+    enter[i] = gum_make_probe_listener (gum_bench_on_hit, NULL, NULL);
+    enter_leave[i] = gum_make_call_listener (gum_bench_on_hit,
+        gum_bench_on_hit, NULL, NULL);
+  }
+
+  g_string_append (json, "  \"ns_per_call\": {\n");
+
+  gum_bench_append_number (json, "    ", "unhooked",
+      gum_bench_measure_calls (interceptor, NULL, 0, FALSE, options), FALSE);
+  gum_bench_append_number (json, "    ", "enter_1",
+      gum_bench_measure_calls (interceptor, enter, 1, FALSE, options), FALSE);
+  gum_bench_append_number (json, "    ", "enter_leave_1",
+      gum_bench_measure_calls (interceptor, enter_leave, 1, FALSE, options),
+      FALSE);
+  gum_bench_append_number (json, "    ", "enter_many",
+      gum_bench_measure_calls (interceptor, enter, GUM_BENCH_MANY_LISTENERS,
+          FALSE, options), FALSE);
+  gum_bench_append_number (json, "    ", "enter_leave_many",
+      gum_bench_measure_calls (interceptor, enter_leave,
+          GUM_BENCH_MANY_LISTENERS, FALSE, options), FALSE);
+  gum_bench_append_number (json, "    ", "replacement",
+      gum_bench_measure_calls (interceptor, NULL, 0, TRUE, options), FALSE);
+  gum_bench_append_number (json, "    ", "replacement_enter_leave_1",
+      gum_bench_measure_calls (interceptor, enter_leave, 1, TRUE, options),
+      TRUE);
+
+  g_string_append (json, "  },\n");
+  g_string_append_printf (json, "  \"many_listeners\": %d,\n",
+      GUM_BENCH_MANY_LISTENERS);
+
+  for (i = 0; i != GUM_BENCH_MANY_LISTENERS; i++)
+  {
+    g_object_unref (enter[i]);
+    g_object_unref (enter_leave[i]);
+  }
+}
+
+static gdouble
+gum_bench_measure_calls (GumInterceptor * interceptor,
+                         GumInvocationListener ** listeners,
+                         guint n_listeners,
+                         gboolean replace,
+                         const GumBenchOptions * options)
+{
+  GTimer * timer;
+  gdouble elapsed;
+  guint i;
+
+  gum_interceptor_begin_transaction (interceptor);
+  if (replace)
+  {
+    gum_interceptor_replace (interceptor, gum_bench_target_function,
+        gum_bench_replacement_function, NULL,
+        (gpointer *) &gum_bench_target_original);
+  }
+  for (i = 0; i != n_listeners; i++)
+  {
+    gum_interceptor_attach (interceptor, gum_bench_target_function,
+        listeners[i], NULL);
+  }
+  gum_interceptor_end_transaction (interceptor);
+
+  /* Warm up the thread context and the invocation stack. */
+  gum_bench_call_target (options->calls / 100 + 1);
+
+  timer = g_timer_new ();
+  gum_bench_call_target (options->calls);
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+
+  gum_interceptor_begin_transaction (interceptor);
+  for (i = 0; i != n_listeners; i++)
+    gum_interceptor_detach (interceptor, listeners[i]);
+  if (replace)
+    gum_interceptor_revert (interceptor, gum_bench_target_function);
+  gum_interceptor_end_transaction (interceptor);
+
+  return elapsed * 1e9 / options->calls;
+}
+
+/*
+ * Attaches and detaches one listener on the same function over and over,
+ * each in its own transaction, so every operation pays for a full commit.
+ */
+static void
+gum_bench_attach_detach (GumInterceptor * interceptor,
+                         const GumBenchOptions * options,
+                         GString * json)
+{
+  GumInvocationListener * listener;
+  GTimer * timer;
+  gdouble attach_seconds = 0, detach_seconds = 0;
+  gint i;
+
+  listener = gum_make_call_listener (gum_bench_on_hit, gum_bench_on_hit, NULL,
+      NULL);
+  timer = g_timer_new ();
+
+  for (i = 0; i != options->attach_cycles; i++)
+  {
+    g_timer_start (timer);
+    gum_interceptor_attach (interceptor, gum_bench_target_function, listener,
+        NULL);
+    attach_seconds += g_timer_elapsed (timer, NULL);
+
+    g_timer_start (timer);
+    gum_interceptor_detach (interceptor, listener);
+    detach_seconds += g_timer_elapsed (timer, NULL);
+  }
+
+  g_timer_destroy (timer);
+  g_object_unref (listener);
+
+  g_string_append (json, "  \"attach_detach\": {\n");
+  g_string_append_printf (json, "    \"cycles\": %d,\n",
+      options->attach_cycles);
+  gum_bench_append_number (json, "    ", "attach_per_second",
+      options->attach_cycles / attach_seconds, FALSE);
+  gum_bench_append_number (json, "    ", "detach_per_second",
+      options->attach_cycles / detach_seconds, TRUE);
+  g_string_append (json, "  },\n");
+}
+
+/*
+ * Latency of gum_interceptor_end_transaction () when a single transaction
+ * attaches to, and then detaches from, functions on 1, 100 and 10k
+ * distinct pages. The functions are emitted into freshly allocated pages so
+ * that each one lands on a page of its own.
+ */
+static void
+gum_bench_transactions (GumInterceptor * interceptor,
+                        const GumBenchOptions * options,
+                        GString * json)
+{
+  static const guint page_counts[] = { 1, 100, GUM_BENCH_MAX_PAGES };
+  GumBenchPages pages;
+  GumInvocationListener * listener;
+  GTimer * timer;
+  gdouble * attach_us, * detach_us;
+  guint i;
+
+  if (!gum_bench_pages_init (&pages, GUM_BENCH_MAX_PAGES))
+  {
+    g_string_append (json, "  \"transaction_end\": null,\n");
+    return;
+  }
+
+  listener = gum_make_probe_listener (gum_bench_on_hit, NULL, NULL);
+  timer = g_timer_new ();
+  attach_us = g_new (gdouble, options->rounds);
+  detach_us = g_new (gdouble, options->rounds);
+
+  g_string_append (json, "  \"transaction_end\": [\n");
+
+  for (i = 0; i != G_N_ELEMENTS (page_counts); i++)
+  {
+    guint n_pages = page_counts[i];
+    GumInterceptorCommitMetrics metrics;
+    gint round;
+    guint j;
+
+    for (round = 0; round != options->rounds; round++)
+    {
+      gum_interceptor_begin_transaction (interceptor);
+      for (j = 0; j != n_pages; j++)
+      {
+        gum_interceptor_attach (interceptor,
+            gum_bench_pages_get_target (&pages, j), listener, NULL);
+      }
+      g_timer_start (timer);
+      gum_interceptor_end_transaction (interceptor);
+      attach_us[round] = g_timer_elapsed (timer, NULL) * 1e6;
+
+      gum_interceptor_begin_transaction (interceptor);
+      gum_interceptor_detach (interceptor, listener);
+      g_timer_start (timer);
+      gum_interceptor_end_transaction (interceptor);
+      detach_us[round] = g_timer_elapsed (timer, NULL) * 1e6;
+    }
+
+    gum_interceptor_get_commit_metrics (interceptor, &metrics);
+
+    g_string_append_printf (json, "    {\n      \"pages\": %u,\n", n_pages);
+    gum_bench_append_number (json, "      ", "attach_us",
+        gum_bench_median (attach_us, options->rounds), FALSE);
+    gum_bench_append_number (json, "      ", "detach_us",
+        gum_bench_median (detach_us, options->rounds), FALSE);
+    gum_bench_append_number (json, "      ", "last_suspend_window_us",
+        metrics.suspend_window_us, TRUE);
+    g_string_append_printf (json, "    }%s\n",
+        (i != G_N_ELEMENTS (page_counts) - 1) ? "," : "");
+  }
+
+  g_string_append (json, "  ],\n");
+
+  g_free (detach_us);
+  g_free (attach_us);
+  g_timer_destroy (timer);
+  g_object_unref (listener);
+
+  gum_bench_pages_destroy (&pages);
+}
+
+/*
+ * Calls the function with one enter/leave listener attached from 1, 2, 4 ...
+ * up to max_threads threads at once. All threads are released together and
+ * the wall time covers the slowest of them.
+ */
+static void
+gum_bench_threads (GumInterceptor * interceptor,
+                   const GumBenchOptions * options,
+                   GString * json)
+{
+  GumInvocationListener * listener;
+  GTimer * timer;
+  guint n_threads;
+
+  listener = gum_make_call_listener (gum_bench_on_hit, gum_bench_on_hit, NULL,
+      NULL);
+  gum_interceptor_attach (interceptor, gum_bench_target_function, listener,
+      NULL);
+  timer = g_timer_new ();
+
+  g_string_append (json, "  \"threads\": [\n");
+
+  for (n_threads = 1; n_threads <= (guint) options->max_threads;
+      n_threads *= 2)
+  {
+    GumBenchStartLine line;
+    GThread ** threads;
+    gdouble elapsed;
+    guint i;
+
+    g_mutex_init (&line.mutex);
+    g_cond_init (&line.cond);
+    line.n_ready = 0;
+    line.go = FALSE;
+    line.n_calls = options->calls / n_threads + 1;
+
+    threads = g_new (GThread *, n_threads);
+    for (i = 0; i != n_threads; i++)
+      threads[i] = g_thread_new ("gum-bench", gum_bench_thread_run, &line);
+
+    g_mutex_lock (&line.mutex);
+    while (line.n_ready != n_threads)
+      g_cond_wait (&line.cond, &line.mutex);
+    g_timer_start (timer);
+    line.go = TRUE;
+    g_cond_broadcast (&line.cond);
+    g_mutex_unlock (&line.mutex);
+
+    for (i = 0; i != n_threads; i++)
+      g_thread_join (threads[i]);
+    elapsed = g_timer_elapsed (timer, NULL);
+
+    g_free (threads);
+    g_cond_clear (&line.cond);
+    g_mutex_clear (&line.mutex);
+
+    g_string_append_printf (json, "    {\n      \"threads\": %u,\n",
+        n_threads);
+    gum_bench_append_number (json, "      ", "ns_per_call",
+        elapsed * 1e9 / line.n_calls, FALSE);
+    gum_bench_append_number (json, "      ", "calls_per_second",
+        (gdouble) line.n_calls * n_threads / elapsed, TRUE);
+    g_string_append_printf (json, "    }%s\n",
+        (n_threads * 2 <= (guint) options->max_threads) ? "," : "");
+  }
+
+  g_string_append (json, "  ]\n");
+
+  g_timer_destroy (timer);
+  gum_interceptor_detach (interceptor, listener);
+  g_object_unref (listener);
+}
+
+static gpointer
+gum_bench_thread_run (gpointer data)
+{
+  GumBenchStartLine * line = data;
+
+  /* Keep the thread context set up outside of the timed window. */
+  gum_bench_call_target (1);
+
+  g_mutex_lock (&line->mutex);
+  line->n_ready++;
+  g_cond_broadcast (&line->cond);
+  while (!line->go)
+    g_cond_wait (&line->cond, &line->mutex);
+  g_mutex_unlock (&line->mutex);
+
+  gum_bench_call_target (line->n_calls);
+
+  return NULL;
+}
+
+/*
+ * Each page starts with a function that does nothing but return, padded
+ * with NOPs so there is room for the widest redirect. Only the x86 and
+ * AArch64 encodings are known here; elsewhere the pages are not set up.
+ */
+static gboolean
+gum_bench_pages_init (GumBenchPages * self,
+                      guint n_pages)
+{
+#if defined (HAVE_I386) || defined (HAVE_ARM64)
+  guint i;
+
+  self->n_pages = n_pages;
+  self->page_size = gum_query_page_size ();
+  self->base = gum_alloc_n_pages (n_pages, GUM_PAGE_RW);
+
+  for (i = 0; i != n_pages; i++)
+  {
+    guint8 * code = gum_bench_pages_get_target (self, i);
+# if defined (HAVE_I386)
+    memset (code, 0x90, GUM_BENCH_TARGET_SIZE - 1);
+    code[GUM_BENCH_TARGET_SIZE - 1] = 0xc3;
+# else
+    guint32 * insns = (guint32 *) code;
+    guint j;
+
+    for (j = 0; j != (GUM_BENCH_TARGET_SIZE / 4) - 1; j++)
+      insns[j] = GUINT32_TO_LE (0xd503201f);
+    insns[j] = GUINT32_TO_LE (0xd65f03c0);
+# endif
+  }
+
+  gum_mprotect (self->base, n_pages * self->page_size, GUM_PAGE_RX);
+  gum_clear_cache (self->base, n_pages * self->page_size);
+
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
+static void
+gum_bench_pages_destroy (GumBenchPages * self)
+{
+  gum_free_pages (self->base);
+}
+
+static gpointer
+gum_bench_pages_get_target (GumBenchPages * self,
+                            guint index)
+{
+  return (guint8 *) self->base + (gsize) index * self->page_size;
+}
+
+static void
+gum_bench_call_target (guint n_calls)
+{
+  guint i;
+
+  for (i = 0; i != n_calls; i++)
+    gum_bench_target (i);
+}
+
+static gint GUM_NOINLINE
+gum_bench_target_function (gint value)
+{
+  gum_bench_sink += value;
+  gum_bench_sink ^= value << 1;
+
+  return gum_bench_sink;
+}
+
+static gint
+gum_bench_replacement_function (gint value)
+{
+  return gum_bench_target_original (value);
+}
+
+static void
+gum_bench_on_hit (GumInvocationContext * ic,
+                  gpointer user_data)
+{
+}
+
+static gint
+gum_bench_compare_doubles (gconstpointer a,
+                           gconstpointer b)
+{
+  gdouble lhs = *(const gdouble *) a;
+  gdouble rhs = *(const gdouble *) b;
+
+  return (lhs > rhs) - (lhs < rhs);
+}
+
+static gdouble
+gum_bench_median (gdouble * samples,
+                  guint n_samples)
+{
+  qsort (samples, n_samples, sizeof (gdouble), gum_bench_compare_doubles);
+
+  return samples[n_samples / 2];
+}
+
+/*
+ * Numbers are formatted with g_ascii_formatd () so that the locale never
+ * turns the decimal point into a comma.
+ */
+static void
+gum_bench_append_number (GString * json,
+                         const gchar * indent,
+                         const gchar * name,
+                         gdouble value,
+                         gboolean last)
+{
+  gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+  g_string_append_printf (json, "%s\"%s\": %s%s\n", indent, name,
+      g_ascii_formatd (buf, sizeof (buf), "%.2f", value), last ? "" : ",");
+}
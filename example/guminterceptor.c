@@ -15,6 +15,9 @@
 #include "gumtls.h"
 
 #include <string.h>
+#ifdef _MSC_VER
+# include <intrin.h>
+#endif
 
 #ifdef HAVE_MIPS
 # define GUM_INTERCEPTOR_CODE_SLICE_SIZE 1024
@@ -22,14 +25,41 @@
 # define GUM_INTERCEPTOR_CODE_SLICE_SIZE 256
 #endif
 
+#define GUM_ADDRESS_INDEX_INITIAL_CAPACITY 64
+
+#define GUM_HOOK_COUNTERS_CHUNK_SIZE 256
+#define GUM_HOOK_COUNTERS_MAX_CHUNKS 256
+#define GUM_HOOK_COUNTERS_MAX_INDICES \
+    (GUM_HOOK_COUNTERS_CHUNK_SIZE * GUM_HOOK_COUNTERS_MAX_CHUNKS)
+
+#define GUM_MAX_LISTENER_DATA_INDICES 4096
+#define GUM_LISTENER_DATA_CHUNK_SIZE 16
+#define GUM_LISTENER_DATA_MAX_CHUNKS \
+    (GUM_MAX_LISTENER_DATA_INDICES / GUM_LISTENER_DATA_CHUNK_SIZE)
+
+#define GUM_INDEX_POOL_INIT(limit) { { NULL }, NULL, 1, (limit) }
+
+#define GUM_EPOCH_IS_BEFORE(a, b) ((gint) ((guint) (a) - (guint) (b)) < 0)
+
 #define GUM_INTERCEPTOR_LOCK(o) g_rec_mutex_lock (&(o)->mutex)
 #define GUM_INTERCEPTOR_UNLOCK(o) g_rec_mutex_unlock (&(o)->mutex)
 
 typedef struct _GumInterceptorTransaction GumInterceptorTransaction;
+typedef struct _GumAddressIndex GumAddressIndex;
+typedef struct _GumAddressIndexSlot GumAddressIndexSlot;
+typedef struct _GumPendingPage GumPendingPage;
 typedef guint GumInstrumentationError;
+typedef guint GumDispatchKind;
 typedef struct _GumDestroyTask GumDestroyTask;
+typedef struct _GumRetiredTask GumRetiredTask;
 typedef struct _GumUpdateTask GumUpdateTask;
 typedef struct _GumSuspendOperation GumSuspendOperation;
+typedef struct _GumPageRange GumPageRange;
+typedef struct _GumInterceptorCommitMetrics GumInterceptorCommitMetrics;
+typedef struct _GumFunctionContextPool GumFunctionContextPool;
+typedef struct _GumHookCounters GumHookCounters;
+typedef struct _GumHookStatistics GumHookStatistics;
+typedef struct _GumIndexPool GumIndexPool;
 typedef struct _ListenerEntry ListenerEntry;
 typedef struct _InterceptorThreadContext InterceptorThreadContext;
 typedef struct _GumInvocationStackEntry GumInvocationStackEntry;
@@ -39,16 +69,54 @@ typedef struct _ListenerInvocationState ListenerInvocationState;
 typedef void (* GumUpdateTaskFunc) (GumInterceptor * self,
     GumFunctionContext * ctx, gpointer prologue);
 
+/*
+ * Robin Hood open addressing keyed on code addresses, with NULL marking an
+ * empty slot. Probes stay short and lookups for absent addresses stop as
+ * soon as they pass an entry closer to its home than they are.
+ */
+struct _GumAddressIndex
+{
+  GumAddressIndexSlot * slots;
+  guint capacity;
+  guint size;
+};
+
+struct _GumAddressIndexSlot
+{
+  gpointer address;
+  gpointer value;
+};
+
+struct _GumPendingPage
+{
+  gpointer page;
+  GArray * tasks;
+};
+
 struct _GumInterceptorTransaction
 {
   gboolean is_dirty;
   gint level;
   GQueue * pending_destroy_tasks;
-  GHashTable * pending_update_tasks;
+  GArray * pending_update_tasks;
 
   GumInterceptor * interceptor;
 };
 
+struct _GumInterceptorCommitMetrics
+{
+  guint n_commits;
+
+  guint n_pages;
+  guint n_ranges;
+  guint n_suspended_threads;
+  gint64 suspend_window_us;
+  gint64 commit_duration_us;
+
+  gint64 max_suspend_window_us;
+  gint64 total_suspend_window_us;
+};
+
 struct _GumInterceptor
 {
 #ifndef GUM_DIET
@@ -59,7 +127,7 @@ struct _GumInterceptor
 
   GRecMutex mutex;
 
-  GHashTable * function_by_address;
+  GumAddressIndex function_by_address;
 
   GumInterceptorBackend * backend;
   GumCodeAllocator allocator;
@@ -67,6 +135,13 @@ struct _GumInterceptor
   volatile guint selected_thread_id;
 
   GumInterceptorTransaction current_transaction;
+  GQueue retired_tasks;
+
+  GumInterceptorCommitMetrics commit_metrics;
+
+  volatile guint latency_sample_rate;
+
+  GHashTable * listener_data_indices;
 };
 
 enum _GumInstrumentationError
@@ -77,6 +152,19 @@ enum _GumInstrumentationError
   GUM_INSTRUMENTATION_ERROR_WRONG_TYPE,
 };
 
+/*
+ * Which begin_invocation path a function takes. Anything but GENERIC is only
+ * a hint: the specialized paths re-check what they rely on and fall back to
+ * the generic one when the configuration changed under them, or when a thread
+ * filter is active.
+ */
+enum _GumDispatchKind
+{
+  GUM_DISPATCH_GENERIC,
+  GUM_DISPATCH_SINGLE_ENTER,
+  GUM_DISPATCH_REPLACEMENT_ONLY,
+};
+
 struct _GumDestroyTask
 {
   GumFunctionContext * ctx;
@@ -84,6 +172,13 @@ struct _GumDestroyTask
   gpointer data;
 };
 
+struct _GumRetiredTask
+{
+  GDestroyNotify notify;
+  gpointer data;
+  guint epoch;
+};
+
 struct _GumUpdateTask
 {
   GumFunctionContext * ctx;
@@ -96,6 +191,72 @@ struct _GumSuspendOperation
   GQueue suspended_threads;
 };
 
+/*
+ * One per (thread, hooked function), written only by the owning thread and
+ * summed by gum_interceptor_snapshot_hook_statistics. Every field is loaded
+ * and stored whole through gum_hook_counter_get/add, so readers never see a
+ * torn value, but there is no read-modify-write on the hot path. A block
+ * whose generation is behind its index's belongs to a previous function and
+ * is cleared by its owner the next time it is used.
+ */
+struct _GumHookCounters
+{
+  volatile guint generation;
+
+  guint64 calls;
+  guint64 guard_bypasses;
+  guint64 ignored_calls;
+
+  guint64 enter_samples;
+  guint64 enter_cycles;
+  guint64 leave_samples;
+  guint64 leave_cycles;
+};
+
+struct _GumHookStatistics
+{
+  gpointer function_address;
+
+  guint64 calls;
+  guint64 guard_bypasses;
+  guint64 ignored_calls;
+
+  guint64 enter_samples;
+  guint64 enter_cycles;
+  guint64 leave_samples;
+  guint64 leave_cycles;
+};
+
+/*
+ * Hands out small indices, recycling released ones first. Index 0 is never
+ * handed out; it is what acquire returns once the pool is exhausted.
+ */
+struct _GumIndexPool
+{
+  GMutex mutex;
+  GArray * free_indices;
+  guint next_index;
+  guint limit;
+};
+
+struct _GumPageRange
+{
+  guint8 * start;
+  gsize size;
+};
+
+/*
+ * Backs the function contexts created by one attach_batch call. Each context
+ * handed out holds a reference, as does the batch while it runs.
+ */
+struct _GumFunctionContextPool
+{
+  volatile gint ref_count;
+  guint capacity;
+  guint used;
+  GumFunctionContext contexts[];
+};
+
 struct _ListenerEntry
 {
 #ifndef GUM_DIET
@@ -109,35 +270,48 @@ struct _ListenerEntry
   };
 #endif
   gpointer function_data;
+  guint data_index;
 };
 
 struct _InterceptorThreadContext
 {
+  GumInterceptor * guard;
+  volatile guint epoch;
+  gint ignore_level;
+
+  GumInvocationStack * stack;
+  guint stack_capacity;
+
   GumInvocationBackend listener_backend;
   GumInvocationBackend replacement_backend;
 
-  gint ignore_level;
+  ListenerDataSlot * listener_data[GUM_LISTENER_DATA_MAX_CHUNKS];
+  GPtrArray * invocation_data;
 
-  GumInvocationStack * stack;
+  guint sample_countdown;
+  GumHookCounters * volatile counters[GUM_HOOK_COUNTERS_MAX_CHUNKS];
 
-  GArray * listener_data_slots;
+  volatile gint in_use;
+  InterceptorThreadContext * next;
 };
 
 struct _GumInvocationStackEntry
 {
   GumFunctionContext * function_ctx;
   gpointer caller_ret_addr;
-  GumInvocationContext invocation_context;
-  GumCpuContext cpu_context;
-  guint8 listener_invocation_data[GUM_MAX_LISTENERS_PER_FUNCTION]
-      [GUM_MAX_LISTENER_DATA];
   gboolean calling_replacement;
   gint original_system_error;
+  guint invocation_data_mask;
+  GumInvocationContext invocation_context;
+  GumCpuContext cpu_context;
 };
 
+/* One bit of invocation_data_mask per listener slot. */
+G_STATIC_ASSERT (GUM_MAX_LISTENERS_PER_FUNCTION <= 32);
+
 struct _ListenerDataSlot
 {
-  GumInvocationListener * owner;
+  guint generation;
   guint8 data[GUM_MAX_LISTENER_DATA];
 };
 
@@ -146,7 +320,8 @@ struct _ListenerInvocationState
   GumPointCut point_cut;
   ListenerEntry * entry;
   InterceptorThreadContext * interceptor_ctx;
-  guint8 * invocation_data;
+  GumInvocationStackEntry * stack_entry;
+  guint listener_index;
 };
 
 #ifndef GUM_DIET
@@ -162,7 +337,9 @@ static GumReplaceReturn gum_interceptor_replace_with_type (
     gpointer * original_function);
 static GumFunctionContext * gum_interceptor_instrument (GumInterceptor * self,
     GumInterceptorType type, gpointer function_address,
-    GumInstrumentationError * error);
+    GumFunctionContextPool * pool, GumInstrumentationError * error);
+static GumAttachReturn gum_attach_return_from_instrumentation_error (
+    GumInstrumentationError error);
 static void gum_interceptor_activate (GumInterceptor * self,
     GumFunctionContext * ctx, gpointer prologue);
 static void gum_interceptor_deactivate (GumInterceptor * self,
@@ -175,6 +352,11 @@ static void gum_interceptor_transaction_destroy (
 static void gum_interceptor_transaction_begin (
     GumInterceptorTransaction * self);
 static void gum_interceptor_transaction_end (GumInterceptorTransaction * self);
+static GArray * gum_interceptor_transaction_get_pending_tasks (
+    GumInterceptorTransaction * self, gpointer page);
+static void gum_interceptor_transaction_apply_updates (
+    GumInterceptorTransaction * self, GumPendingPage * pending,
+    guint8 * source_page);
 static gboolean gum_maybe_suspend_thread (const GumThreadDetails * details,
     gpointer user_data);
 static void gum_interceptor_transaction_schedule_destroy (
@@ -183,44 +365,89 @@ static void gum_interceptor_transaction_schedule_destroy (
 static void gum_interceptor_transaction_schedule_update (
     GumInterceptorTransaction * self, GumFunctionContext * ctx,
     GumUpdateTaskFunc func);
+static void gum_interceptor_retire (GumInterceptor * self,
+    GDestroyNotify notify, gpointer data);
+static void gum_interceptor_reclaim (GumInterceptor * self);
 
 static GumFunctionContext * gum_function_context_new (
     GumInterceptor * interceptor, gpointer function_address,
-    GumInterceptorType type);
+    GumInterceptorType type, GumFunctionContextPool * pool);
 static void gum_function_context_finalize (GumFunctionContext * function_ctx);
 static void gum_function_context_destroy (GumFunctionContext * function_ctx);
 static void gum_function_context_perform_destroy (
     GumFunctionContext * function_ctx);
 static gboolean gum_function_context_is_empty (
     GumFunctionContext * function_ctx);
-static void gum_function_context_add_listener (
-    GumFunctionContext * function_ctx, GumInvocationListener * listener,
-    gpointer function_data);
+static void gum_function_context_add_listeners (
+    GumFunctionContext * function_ctx,
+    GumInvocationListener * const * listeners, gpointer const * function_data,
+    guint n_listeners);
 static void gum_function_context_remove_listener (
     GumFunctionContext * function_ctx, GumInvocationListener * listener);
 static void listener_entry_free (ListenerEntry * entry);
+static GumFunctionContextPool * gum_function_context_pool_new (
+    guint capacity);
+static void gum_function_context_pool_unref (GumFunctionContextPool * pool);
 static gboolean gum_function_context_has_listener (
     GumFunctionContext * function_ctx, GumInvocationListener * listener);
 static ListenerEntry ** gum_function_context_find_listener (
     GumFunctionContext * function_ctx, GumInvocationListener * listener);
 static ListenerEntry ** gum_function_context_find_taken_listener_slot (
     GumFunctionContext * function_ctx);
+static void gum_function_context_update_dispatch (
+    GumFunctionContext * function_ctx);
+static gboolean gum_function_context_begin_single_enter (
+    GumFunctionContext * function_ctx,
+    InterceptorThreadContext * interceptor_ctx, GumCpuContext * cpu_context,
+    gint system_error, gpointer * next_hop);
+static void gum_function_context_begin_replacement (
+    GumFunctionContext * function_ctx,
+    InterceptorThreadContext * interceptor_ctx, GumCpuContext * cpu_context,
+    gpointer * caller_ret_addr, gint system_error, gpointer * next_hop);
 static void gum_function_context_fixup_cpu_context (
     GumFunctionContext * function_ctx, GumCpuContext * cpu_context);
+static void gum_function_context_collect_statistics (
+    GumFunctionContext * function_ctx, GumHookStatistics * stats);
+static void gum_hook_counters_index_release (guint index);
+static void gum_hook_counters_refresh (GumHookCounters * counters,
+    guint index);
+static guint64 gum_hook_counter_get (guint64 * counter);
+static void gum_hook_counter_set (guint64 * counter, guint64 value);
+static void gum_hook_counter_add (guint64 * counter, guint64 delta);
+static guint gum_interceptor_obtain_listener_data_index (GumInterceptor * self,
+    GumInvocationListener * listener);
+static void gum_listener_data_index_release (gpointer index);
+static guint gum_index_pool_acquire (GumIndexPool * self);
+static void gum_index_pool_release (GumIndexPool * self, guint index);
+static guint64 gum_read_cycle_counter (void);
 
 static InterceptorThreadContext * get_interceptor_thread_context (void);
+static InterceptorThreadContext * obtain_interceptor_thread_context (void);
+static void interceptor_thread_context_enter (InterceptorThreadContext * self,
+    GumInterceptor * interceptor);
+static void interceptor_thread_context_leave (InterceptorThreadContext * self);
+static GumHookCounters * interceptor_thread_context_get_counters (
+    InterceptorThreadContext * self, guint index);
+static GumHookCounters * interceptor_thread_context_peek_counters (
+    InterceptorThreadContext * self, guint index);
+static guint64 interceptor_thread_context_maybe_sample (
+    InterceptorThreadContext * self, guint rate);
 static void release_interceptor_thread_context (
     InterceptorThreadContext * context);
 static InterceptorThreadContext * interceptor_thread_context_new (void);
 static void interceptor_thread_context_destroy (
     InterceptorThreadContext * context);
 static gpointer interceptor_thread_context_get_listener_data (
-    InterceptorThreadContext * self, GumInvocationListener * listener,
-    gsize required_size);
-static void interceptor_thread_context_forget_listener_data (
-    InterceptorThreadContext * self, GumInvocationListener * listener);
+    InterceptorThreadContext * self, guint index, gsize required_size);
+static void interceptor_thread_context_free_listener_data (
+    InterceptorThreadContext * self);
+static gpointer interceptor_thread_context_get_invocation_data (
+    InterceptorThreadContext * self, GumInvocationStackEntry * entry,
+    guint listener_index);
+static void interceptor_thread_context_grow_stack (
+    InterceptorThreadContext * self);
 static GumInvocationStackEntry * gum_invocation_stack_push (
-    GumInvocationStack * stack, GumFunctionContext * function_ctx,
+    InterceptorThreadContext * context, GumFunctionContext * function_ctx,
     gpointer caller_ret_addr);
 static gpointer gum_invocation_stack_pop (GumInvocationStack * stack);
 static GumInvocationStackEntry * gum_invocation_stack_peek_top (
@@ -231,8 +458,26 @@ static gpointer gum_interceptor_resolve (GumInterceptor * self,
 static gboolean gum_interceptor_has (GumInterceptor * self,
     gpointer function_address);
 
+static void gum_address_index_init (GumAddressIndex * self);
+static void gum_address_index_clear (GumAddressIndex * self,
+    GDestroyNotify notify);
+static gpointer gum_address_index_lookup (GumAddressIndex * self,
+    gpointer address);
+static void gum_address_index_insert (GumAddressIndex * self,
+    gpointer address, gpointer value);
+static gpointer gum_address_index_remove (GumAddressIndex * self,
+    gpointer address);
+static void gum_address_index_remove_at (GumAddressIndex * self, guint i);
+static gint gum_address_index_find (GumAddressIndex * self,
+    gpointer address);
+static void gum_address_index_place (GumAddressIndex * self,
+    gpointer address, gpointer value);
+static guint gum_address_index_home (GumAddressIndex * self,
+    gpointer address);
+
 static gpointer gum_page_address_from_pointer (gpointer ptr);
-static gint gum_page_address_compare (gconstpointer a, gconstpointer b);
+static GArray * gum_page_ranges_from_pages (GumPendingPage * pages,
+    guint n_pages, gsize page_size);
 
 #ifndef GUM_DIET
 G_DEFINE_TYPE (GumInterceptor, gum_interceptor, G_TYPE_OBJECT)
@@ -241,11 +486,43 @@ G_DEFINE_TYPE (GumInterceptor, gum_interceptor, G_TYPE_OBJECT)
 static GMutex _gum_interceptor_lock;
 static GumInterceptor * _the_interceptor = NULL;
 
-static GumSpinlock gum_interceptor_thread_context_lock = GUM_SPINLOCK_INIT;
-static GHashTable * gum_interceptor_thread_contexts;
+/*
+ * Thread contexts are never unlinked: a thread that exits hands its context
+ * back by clearing in_use, and the next new thread claims it.
+ */
+static InterceptorThreadContext * gum_interceptor_thread_contexts = NULL;
+/*
+ * Epochs wrap around. Zero means "not inside a hook" and is never handed
+ * out, and epochs are only ever compared with GUM_EPOCH_IS_BEFORE ().
+ */
+static volatile guint gum_interceptor_epoch = 1;
+static gboolean gum_interceptor_thread_contexts_active = FALSE;
+static InterceptorThreadContext gum_interceptor_bootstrap_context;
+
+/*
+ * Hooked functions are numbered so each thread can keep their counters in a
+ * flat, chunked table. Index 0 is where functions go once the numbering runs
+ * out, and is never reported.
+ */
+static GumIndexPool gum_hook_counters_indices =
+    GUM_INDEX_POOL_INIT (GUM_HOOK_COUNTERS_MAX_INDICES);
+static volatile guint
+    gum_hook_counters_generations[GUM_HOOK_COUNTERS_MAX_INDICES];
+static GumHookCounters gum_hook_counters_discarded;
+
+/*
+ * Each listener owns one index for as long as it is attached anywhere, and
+ * every thread keeps its data for that listener at that index. Bumping the
+ * index's generation forgets the data on all threads at once: each thread
+ * notices the mismatch and clears its slot the next time it looks.
+ */
+static GumIndexPool gum_listener_data_indices =
+    GUM_INDEX_POOL_INIT (GUM_MAX_LISTENER_DATA_INDICES);
+static volatile guint
+    gum_listener_data_generations[GUM_MAX_LISTENER_DATA_INDICES];
 static GPrivate gum_interceptor_context_private =
     G_PRIVATE_INIT ((GDestroyNotify) release_interceptor_thread_context);
-static GumTlsKey gum_interceptor_guard_key;
+static GumTlsKey gum_interceptor_context_key;
 
 static GumInvocationStack _gum_interceptor_empty_stack = { NULL, 0 };
 
@@ -265,19 +542,26 @@ gum_interceptor_class_init (GumInterceptorClass * klass)
 void
 _gum_interceptor_init (void)
 {
-  gum_interceptor_thread_contexts = g_hash_table_new_full (NULL, NULL,
-      (GDestroyNotify) interceptor_thread_context_destroy, NULL);
+  gum_interceptor_context_key = gum_tls_key_new ();
 
-  gum_interceptor_guard_key = gum_tls_key_new ();
+  gum_interceptor_thread_contexts_active = TRUE;
 }
 
 void
 _gum_interceptor_deinit (void)
 {
-  gum_tls_key_free (gum_interceptor_guard_key);
+  InterceptorThreadContext * context, * next;
+
+  gum_interceptor_thread_contexts_active = FALSE;
+
+  context = g_atomic_pointer_exchange (&gum_interceptor_thread_contexts, NULL);
+  for (; context != NULL; context = next)
+  {
+    next = context->next;
+    interceptor_thread_context_destroy (context);
+  }
 
-  g_hash_table_unref (gum_interceptor_thread_contexts);
-  gum_interceptor_thread_contexts = NULL;
+  gum_tls_key_free (gum_interceptor_context_key);
 }
 
 static void
@@ -285,12 +569,15 @@ gum_interceptor_init (GumInterceptor * self)
 {
   g_rec_mutex_init (&self->mutex);
 
-  self->function_by_address = g_hash_table_new_full (NULL, NULL, NULL,
-      (GDestroyNotify) gum_function_context_destroy);
+  gum_address_index_init (&self->function_by_address);
 
   gum_code_allocator_init (&self->allocator, GUM_INTERCEPTOR_CODE_SLICE_SIZE);
 
   gum_interceptor_transaction_init (&self->current_transaction, self);
+  g_queue_init (&self->retired_tasks);
+
+  self->listener_data_indices = g_hash_table_new_full (NULL, NULL, NULL,
+      gum_listener_data_index_release);
 }
 
 static void
@@ -300,7 +587,8 @@ gum_interceptor_do_dispose (GumInterceptor * self)
   gum_interceptor_transaction_begin (&self->current_transaction);
   self->current_transaction.is_dirty = TRUE;
 
-  g_hash_table_remove_all (self->function_by_address);
+  gum_address_index_clear (&self->function_by_address,
+      (GDestroyNotify) gum_function_context_destroy);
 
   gum_interceptor_transaction_end (&self->current_transaction);
   GUM_INTERCEPTOR_UNLOCK (self);
@@ -309,14 +597,25 @@ gum_interceptor_do_dispose (GumInterceptor * self)
 static void
 gum_interceptor_do_finalize (GumInterceptor * self)
 {
+  GumRetiredTask * task;
+
   gum_interceptor_transaction_destroy (&self->current_transaction);
 
+  while ((task = g_queue_pop_head (&self->retired_tasks)) != NULL)
+  {
+    task->notify (task->data);
+
+    g_slice_free (GumRetiredTask, task);
+  }
+
   if (self->backend != NULL)
     _gum_interceptor_backend_destroy (self->backend);
 
   g_rec_mutex_clear (&self->mutex);
 
-  g_hash_table_unref (self->function_by_address);
+  gum_address_index_clear (&self->function_by_address, NULL);
+
+  g_hash_table_unref (self->listener_data_indices);
 
   gum_code_allocator_free (&self->allocator);
 }
@@ -432,7 +731,7 @@ gum_interceptor_attach (GumInterceptor * self,
   function_address = gum_interceptor_resolve (self, function_address);
 
   function_ctx = gum_interceptor_instrument (self, GUM_INTERCEPTOR_TYPE_DEFAULT,
-      function_address, &error);
+      function_address, NULL, &error);
 
   if (function_ctx == NULL)
     goto instrumentation_error;
@@ -440,8 +739,91 @@ gum_interceptor_attach (GumInterceptor * self,
   if (gum_function_context_has_listener (function_ctx, listener))
     goto already_attached;
 
-  gum_function_context_add_listener (function_ctx, listener,
-      listener_function_data);
+  gum_function_context_add_listeners (function_ctx, &listener,
+      &listener_function_data, 1);
+
+  goto beach;
+
+instrumentation_error:
+  {
+    switch (error)
+    {
+      case GUM_INSTRUMENTATION_ERROR_WRONG_SIGNATURE:
+        result = GUM_ATTACH_WRONG_SIGNATURE;
+        break;
+      case GUM_INSTRUMENTATION_ERROR_POLICY_VIOLATION:
+        result = GUM_ATTACH_POLICY_VIOLATION;
+        break;
+      case GUM_INSTRUMENTATION_ERROR_WRONG_TYPE:
+        result = GUM_ATTACH_WRONG_TYPE;
+        break;
+      default:
+        g_assert_not_reached ();
+    }
+    goto beach;
+  }
+already_attached:
+  {
+    result = GUM_ATTACH_ALREADY_ATTACHED;
+    goto beach;
+  }
+beach:
+  {
+    gum_interceptor_transaction_end (&self->current_transaction);
+    GUM_INTERCEPTOR_UNLOCK (self);
+    gum_interceptor_unignore_current_thread (self);
+
+    return result;
+  }
+}
+
+/*
+ * Attaches all of the listeners to one function, publishing a single new
+ * listener array instead of one per listener. Nothing is attached if any of
+ * them already is, or appears twice.
+ */
+GumAttachReturn
+gum_interceptor_attach_many (GumInterceptor * self,
+                             gpointer function_address,
+                             GumInvocationListener * const * listeners,
+                             gpointer const * listener_function_data,
+                             guint n_listeners)
+{
+  GumAttachReturn result = GUM_ATTACH_OK;
+  GumFunctionContext * function_ctx;
+  GumInstrumentationError error;
+  guint i, j;
+
+  for (i = 0; i != n_listeners; i++)
+  {
+    for (j = 0; j != i; j++)
+    {
+      if (listeners[j] == listeners[i])
+        return GUM_ATTACH_ALREADY_ATTACHED;
+    }
+  }
+
+  gum_interceptor_ignore_current_thread (self);
+  GUM_INTERCEPTOR_LOCK (self);
+  gum_interceptor_transaction_begin (&self->current_transaction);
+  self->current_transaction.is_dirty = TRUE;
+
+  function_address = gum_interceptor_resolve (self, function_address);
+
+  function_ctx = gum_interceptor_instrument (self, GUM_INTERCEPTOR_TYPE_DEFAULT,
+      function_address, NULL, &error);
+
+  if (function_ctx == NULL)
+    goto instrumentation_error;
+
+  for (i = 0; i != n_listeners; i++)
+  {
+    if (gum_function_context_has_listener (function_ctx, listeners[i]))
+      goto already_attached;
+  }
+
+  gum_function_context_add_listeners (function_ctx, listeners,
+      listener_function_data, n_listeners);
 
   goto beach;
 
@@ -478,29 +860,97 @@ beach:
   }
 }
 
+/*
+ * Attaches the listener to every function in one transaction, taking the
+ * lock once and carving the new function contexts out of one allocation.
+ * Returns how many were attached; results, if given, receives the outcome
+ * for each function.
+ */
+guint
+gum_interceptor_attach_batch (GumInterceptor * self,
+                              gpointer const * function_addresses,
+                              guint n_functions,
+                              GumInvocationListener * listener,
+                              gpointer listener_function_data,
+                              GumAttachReturn * results)
+{
+  guint n_attached = 0;
+  GumFunctionContextPool * pool;
+  guint i;
+
+  pool = gum_function_context_pool_new (n_functions);
+
+  gum_interceptor_ignore_current_thread (self);
+  GUM_INTERCEPTOR_LOCK (self);
+  gum_interceptor_transaction_begin (&self->current_transaction);
+  self->current_transaction.is_dirty = TRUE;
+
+  for (i = 0; i != n_functions; i++)
+  {
+    GumAttachReturn result = GUM_ATTACH_OK;
+    gpointer function_address;
+    GumFunctionContext * function_ctx;
+    GumInstrumentationError error;
+
+    function_address = gum_interceptor_resolve (self, function_addresses[i]);
+
+    function_ctx = gum_interceptor_instrument (self,
+        GUM_INTERCEPTOR_TYPE_DEFAULT, function_address, pool, &error);
+
+    if (function_ctx == NULL)
+    {
+      result = gum_attach_return_from_instrumentation_error (error);
+    }
+    else if (gum_function_context_has_listener (function_ctx, listener))
+    {
+      result = GUM_ATTACH_ALREADY_ATTACHED;
+    }
+    else
+    {
+      gum_function_context_add_listeners (function_ctx, &listener,
+          &listener_function_data, 1);
+      n_attached++;
+    }
+
+    if (results != NULL)
+      results[i] = result;
+  }
+
+  gum_interceptor_transaction_end (&self->current_transaction);
+  GUM_INTERCEPTOR_UNLOCK (self);
+  gum_interceptor_unignore_current_thread (self);
+
+  gum_function_context_pool_unref (pool);
+
+  return n_attached;
+}
+
 void
 gum_interceptor_detach (GumInterceptor * self,
                         GumInvocationListener * listener)
 {
-  GHashTableIter iter;
-  gpointer key, value;
+  GumAddressIndex * index = &self->function_by_address;
+  gpointer data_index;
+  guint i;
 
   gum_interceptor_ignore_current_thread (self);
   GUM_INTERCEPTOR_LOCK (self);
   gum_interceptor_transaction_begin (&self->current_transaction);
   self->current_transaction.is_dirty = TRUE;
 
-  g_hash_table_iter_init (&iter, self->function_by_address);
-  while (g_hash_table_iter_next (&iter, NULL, &value))
+  /* Removal shifts later entries back into slot i, so only advance past
+   * slots that were kept. */
+  i = 0;
+  while (i != index->capacity)
   {
-    GumFunctionContext * function_ctx = value;
+    GumFunctionContext * function_ctx = index->slots[i].value;
 
-    if (gum_function_context_has_listener (function_ctx, listener))
+    if (index->slots[i].address != NULL &&
+        gum_function_context_has_listener (function_ctx, listener))
     {
       gum_function_context_remove_listener (function_ctx, listener);
 
-      gum_interceptor_transaction_schedule_destroy (&self->current_transaction,
-          function_ctx,
+      gum_interceptor_retire (self,
 #ifndef GUM_DIET
           g_object_unref, g_object_ref (listener)
 #else
@@ -510,20 +960,20 @@ gum_interceptor_detach (GumInterceptor * self,
 
       if (gum_function_context_is_empty (function_ctx))
       {
-        g_hash_table_iter_remove (&iter);
+        gum_address_index_remove_at (index, i);
+        gum_function_context_destroy (function_ctx);
+        continue;
       }
     }
+
+    i++;
   }
 
-  gum_spinlock_acquire (&gum_interceptor_thread_context_lock);
-  g_hash_table_iter_init (&iter, gum_interceptor_thread_contexts);
-  while (g_hash_table_iter_next (&iter, &key, NULL))
+  if (g_hash_table_steal_extended (self->listener_data_indices, listener, NULL,
+      &data_index))
   {
-    InterceptorThreadContext * thread_ctx = key;
-
-    interceptor_thread_context_forget_listener_data (thread_ctx, listener);
+    gum_interceptor_retire (self, gum_listener_data_index_release, data_index);
   }
-  gum_spinlock_release (&gum_interceptor_thread_context_lock);
 
   gum_interceptor_transaction_end (&self->current_transaction);
   GUM_INTERCEPTOR_UNLOCK (self);
@@ -572,7 +1022,7 @@ gum_interceptor_replace_with_type (GumInterceptor * self,
   function_address = gum_interceptor_resolve (self, function_address);
 
   function_ctx =
-      gum_interceptor_instrument (self, type, function_address, &error);
+      gum_interceptor_instrument (self, type, function_address, NULL, &error);
 
   if (function_ctx == NULL)
     goto instrumentation_error;
@@ -582,6 +1032,7 @@ gum_interceptor_replace_with_type (GumInterceptor * self,
 
   function_ctx->replacement_data = replacement_data;
   function_ctx->replacement_function = replacement_function;
+  gum_function_context_update_dispatch (function_ctx);
 
   if (original_function != NULL)
     *original_function = function_ctx->on_invoke_trampoline;
@@ -632,17 +1083,19 @@ gum_interceptor_revert (GumInterceptor * self,
 
   function_address = gum_interceptor_resolve (self, function_address);
 
-  function_ctx = (GumFunctionContext *) g_hash_table_lookup (
-      self->function_by_address, function_address);
+  function_ctx = gum_address_index_lookup (&self->function_by_address,
+      function_address);
   if (function_ctx == NULL)
     goto beach;
 
   function_ctx->replacement_function = NULL;
   function_ctx->replacement_data = NULL;
+  gum_function_context_update_dispatch (function_ctx);
 
   if (gum_function_context_is_empty (function_ctx))
   {
-    g_hash_table_remove (self->function_by_address, function_address);
+    gum_address_index_remove (&self->function_by_address, function_address);
+    gum_function_context_destroy (function_ctx);
   }
 
 beach:
@@ -679,7 +1132,8 @@ gum_interceptor_flush (GumInterceptor * self)
     gum_interceptor_transaction_end (&self->current_transaction);
 
     flushed =
-        g_queue_is_empty (self->current_transaction.pending_destroy_tasks);
+        g_queue_is_empty (self->current_transaction.pending_destroy_tasks) &&
+        g_queue_is_empty (&self->retired_tasks);
   }
 
   GUM_INTERCEPTOR_UNLOCK (self);
@@ -687,6 +1141,58 @@ gum_interceptor_flush (GumInterceptor * self)
   return flushed;
 }
 
+void
+gum_interceptor_get_commit_metrics (GumInterceptor * self,
+                                    GumInterceptorCommitMetrics * metrics)
+{
+  GUM_INTERCEPTOR_LOCK (self);
+  *metrics = self->commit_metrics;
+  GUM_INTERCEPTOR_UNLOCK (self);
+}
+
+/*
+ * Sets how often, per thread, enter and leave are timed with the cycle
+ * counter: every rate-th call, or never when rate is 0.
+ */
+void
+gum_interceptor_set_latency_sample_rate (GumInterceptor * self,
+                                         guint rate)
+{
+  g_atomic_int_set (&self->latency_sample_rate, rate);
+}
+
+/*
+ * Sums every thread's counters for every instrumented function. Threads keep
+ * running while this reads, so the totals are a consistent-enough view
+ * rather than an exact cut.
+ */
+GArray *
+gum_interceptor_snapshot_hook_statistics (GumInterceptor * self)
+{
+  GArray * snapshot;
+  GumAddressIndex * index = &self->function_by_address;
+  guint i;
+
+  snapshot = g_array_new (FALSE, TRUE, sizeof (GumHookStatistics));
+
+  GUM_INTERCEPTOR_LOCK (self);
+
+  for (i = 0; i != index->capacity; i++)
+  {
+    GumHookStatistics stats = { 0, };
+
+    if (index->slots[i].address == NULL)
+      continue;
+
+    gum_function_context_collect_statistics (index->slots[i].value, &stats);
+    g_array_append_val (snapshot, stats);
+  }
+
+  GUM_INTERCEPTOR_UNLOCK (self);
+
+  return snapshot;
+}
+
 GumInvocationContext *
 gum_interceptor_get_current_invocation (void)
 {
@@ -694,6 +1200,9 @@ gum_interceptor_get_current_invocation (void)
   GumInvocationStackEntry * entry;
 
   interceptor_ctx = get_interceptor_thread_context ();
+  if (interceptor_ctx == &gum_interceptor_bootstrap_context)
+    return NULL;
+
   entry = gum_invocation_stack_peek_top (interceptor_ctx->stack);
   if (entry == NULL)
     return NULL;
@@ -706,19 +1215,27 @@ gum_interceptor_get_current_stack (void)
 {
   InterceptorThreadContext * context;
 
-  context = g_private_get (&gum_interceptor_context_private);
-  if (context == NULL)
+  context = gum_tls_key_get_value (gum_interceptor_context_key);
+  if (context == NULL || context == &gum_interceptor_bootstrap_context)
     return &_gum_interceptor_empty_stack;
 
   return context->stack;
 }
 
+/*
+ * A thread still creating its context shares the bootstrap context with
+ * every other such thread, and bypasses all listeners anyway, so ignoring
+ * and unignoring it are no-ops.
+ */
 void
 gum_interceptor_ignore_current_thread (GumInterceptor * self)
 {
   InterceptorThreadContext * interceptor_ctx;
 
   interceptor_ctx = get_interceptor_thread_context ();
+  if (interceptor_ctx == &gum_interceptor_bootstrap_context)
+    return;
+
   interceptor_ctx->ignore_level++;
 }
 
@@ -728,6 +1245,9 @@ gum_interceptor_unignore_current_thread (GumInterceptor * self)
   InterceptorThreadContext * interceptor_ctx;
 
   interceptor_ctx = get_interceptor_thread_context ();
+  if (interceptor_ctx == &gum_interceptor_bootstrap_context)
+    return;
+
   interceptor_ctx->ignore_level--;
 }
 
@@ -737,8 +1257,11 @@ gum_interceptor_maybe_unignore_current_thread (GumInterceptor * self)
   InterceptorThreadContext * interceptor_ctx;
 
   interceptor_ctx = get_interceptor_thread_context ();
-  if (interceptor_ctx->ignore_level <= 0)
+  if (interceptor_ctx == &gum_interceptor_bootstrap_context ||
+      interceptor_ctx->ignore_level <= 0)
+  {
     return FALSE;
+  }
 
   interceptor_ctx->ignore_level--;
   return TRUE;
@@ -845,13 +1368,14 @@ static GumFunctionContext *
 gum_interceptor_instrument (GumInterceptor * self,
                             GumInterceptorType type,
                             gpointer function_address,
+                            GumFunctionContextPool * pool,
                             GumInstrumentationError * error)
 {
   GumFunctionContext * ctx;
 
   *error = GUM_INSTRUMENTATION_ERROR_NONE;
 
-  ctx = (GumFunctionContext *) g_hash_table_lookup (self->function_by_address,
+  ctx = gum_address_index_lookup (&self->function_by_address,
       function_address);
 
   if (ctx != NULL)
@@ -870,7 +1394,7 @@ gum_interceptor_instrument (GumInterceptor * self,
         _gum_interceptor_backend_create (&self->mutex, &self->allocator);
   }
 
-  ctx = gum_function_context_new (self, function_address, type);
+  ctx = gum_function_context_new (self, function_address, type, pool);
 
   if (gum_process_get_code_signing_policy () == GUM_CODE_SIGNING_REQUIRED)
   {
@@ -883,7 +1407,8 @@ gum_interceptor_instrument (GumInterceptor * self,
       goto wrong_signature;
   }
 
-  g_hash_table_insert (self->function_by_address, function_address, ctx);
+  gum_address_index_insert (&self->function_by_address, function_address,
+      ctx);
 
   gum_interceptor_transaction_schedule_update (&self->current_transaction, ctx,
       gum_interceptor_activate);
@@ -908,6 +1433,24 @@ propagate_error:
   }
 }
 
+static GumAttachReturn
+gum_attach_return_from_instrumentation_error (GumInstrumentationError error)
+{
+  switch (error)
+  {
+    case GUM_INSTRUMENTATION_ERROR_WRONG_SIGNATURE:
+      return GUM_ATTACH_WRONG_SIGNATURE;
+    case GUM_INSTRUMENTATION_ERROR_POLICY_VIOLATION:
+      return GUM_ATTACH_POLICY_VIOLATION;
+    case GUM_INSTRUMENTATION_ERROR_WRONG_TYPE:
+      return GUM_ATTACH_WRONG_TYPE;
+    default:
+      g_assert_not_reached ();
+  }
+
+  return GUM_ATTACH_OK;
+}
+
 static void
 gum_interceptor_activate (GumInterceptor * self,
                           GumFunctionContext * ctx,
@@ -943,8 +1486,8 @@ gum_interceptor_transaction_init (GumInterceptorTransaction * transaction,
   transaction->is_dirty = FALSE;
   transaction->level = 0;
   transaction->pending_destroy_tasks = g_queue_new ();
-  transaction->pending_update_tasks = g_hash_table_new_full (
-      NULL, NULL, NULL, (GDestroyNotify) g_array_unref);
+  transaction->pending_update_tasks =
+      g_array_new (FALSE, FALSE, sizeof (GumPendingPage));
 
   transaction->interceptor = interceptor;
 }
@@ -953,8 +1496,14 @@ static void
 gum_interceptor_transaction_destroy (GumInterceptorTransaction * transaction)
 {
   GumDestroyTask * task;
+  guint i;
 
-  g_hash_table_unref (transaction->pending_update_tasks);
+  for (i = 0; i != transaction->pending_update_tasks->len; i++)
+  {
+    g_array_unref (g_array_index (transaction->pending_update_tasks,
+        GumPendingPage, i).tasks);
+  }
+  g_array_free (transaction->pending_update_tasks, TRUE);
 
   while ((task = g_queue_pop_head (transaction->pending_destroy_tasks)) != NULL)
   {
@@ -976,63 +1525,68 @@ gum_interceptor_transaction_end (GumInterceptorTransaction * self)
 {
   GumInterceptor * interceptor = self->interceptor;
   GumInterceptorTransaction transaction_copy;
-  GList * addresses, * cur;
+  GumPendingPage * pages;
+  guint num_pages;
+  GArray * ranges;
+  GumInterceptorCommitMetrics * metrics;
+  gint64 commit_start;
+  guint page_size, i;
 
   self->level--;
   if (self->level > 0)
     return;
 
   if (!self->is_dirty)
-    return;
+  {
+    if (!g_queue_is_empty (&interceptor->retired_tasks))
+    {
+      gum_interceptor_ignore_current_thread (interceptor);
+      gum_interceptor_reclaim (interceptor);
+      gum_interceptor_unignore_current_thread (interceptor);
+    }
+
+    return;
+  }
 
   gum_interceptor_ignore_current_thread (interceptor);
 
   gum_code_allocator_commit (&interceptor->allocator);
 
   if (g_queue_is_empty (self->pending_destroy_tasks) &&
-      g_hash_table_size (self->pending_update_tasks) == 0)
+      self->pending_update_tasks->len == 0)
   {
     interceptor->current_transaction.is_dirty = FALSE;
     goto no_changes;
   }
 
+  commit_start = g_get_monotonic_time ();
+
   transaction_copy = interceptor->current_transaction;
   self = &transaction_copy;
   gum_interceptor_transaction_init (&interceptor->current_transaction,
       interceptor);
 
-  addresses = g_hash_table_get_keys (self->pending_update_tasks);
-  addresses = g_list_sort (addresses, gum_page_address_compare);
-
-  if (gum_process_get_code_signing_policy () == GUM_CODE_SIGNING_REQUIRED)
-  {
-    for (cur = addresses; cur != NULL; cur = cur->next)
-    {
-      gpointer target_page = cur->data;
-      GArray * pending;
-      guint i;
-
-      pending = g_hash_table_lookup (self->pending_update_tasks, target_page);
-      g_assert (pending != NULL);
+  page_size = gum_query_page_size ();
 
-      for (i = 0; i != pending->len; i++)
-      {
-        GumUpdateTask * update;
+  pages = (GumPendingPage *) self->pending_update_tasks->data;
+  num_pages = self->pending_update_tasks->len;
+  ranges = gum_page_ranges_from_pages (pages, num_pages, page_size);
 
-        update = &g_array_index (pending, GumUpdateTask, i);
+  metrics = &interceptor->commit_metrics;
+  metrics->n_pages = num_pages;
+  metrics->n_ranges = ranges->len;
+  metrics->n_suspended_threads = 0;
+  metrics->suspend_window_us = 0;
 
-        update->func (interceptor, update->ctx,
-            _gum_interceptor_backend_get_function_address (update->ctx));
-      }
-    }
+  if (gum_process_get_code_signing_policy () == GUM_CODE_SIGNING_REQUIRED)
+  {
+    for (i = 0; i != num_pages; i++)
+      gum_interceptor_transaction_apply_updates (self, &pages[i], NULL);
   }
   else
   {
-    guint page_size;
     gboolean rwx_supported, code_segment_supported;
 
-    page_size = gum_query_page_size ();
-
     rwx_supported = gum_query_is_rwx_supported ();
     code_segment_supported = gum_code_segment_is_supported ();
 
@@ -1040,113 +1594,84 @@ gum_interceptor_transaction_end (GumInterceptorTransaction * self)
     {
       GumPageProtection protection;
       GumSuspendOperation suspend_op = { 0, G_QUEUE_INIT };
+      gint64 suspend_start = 0;
 
       protection = rwx_supported ? GUM_PAGE_RWX : GUM_PAGE_RW;
 
+      /*
+       * Everything up to here, including sorting and coalescing the pages,
+       * was done before suspending so the window only covers the patching.
+       */
       if (!rwx_supported)
       {
+        suspend_start = g_get_monotonic_time ();
+
         suspend_op.current_thread_id = gum_process_get_current_thread_id ();
         gum_process_enumerate_threads (gum_maybe_suspend_thread, &suspend_op);
       }
 
-      for (cur = addresses; cur != NULL; cur = cur->next)
+      for (i = 0; i != ranges->len; i++)
       {
-        gpointer target_page = cur->data;
+        GumPageRange * range = &g_array_index (ranges, GumPageRange, i);
 
-        gum_mprotect (target_page, page_size, protection);
+        gum_mprotect (range->start, range->size, protection);
       }
 
-      for (cur = addresses; cur != NULL; cur = cur->next)
-      {
-        gpointer target_page = cur->data;
-        GArray * pending;
-        guint i;
-
-        pending = g_hash_table_lookup (self->pending_update_tasks,
-            target_page);
-        g_assert (pending != NULL);
-
-        for (i = 0; i != pending->len; i++)
-        {
-          GumUpdateTask * update;
-
-          update = &g_array_index (pending, GumUpdateTask, i);
-
-          update->func (interceptor, update->ctx,
-              _gum_interceptor_backend_get_function_address (update->ctx));
-        }
-      }
+      for (i = 0; i != num_pages; i++)
+        gum_interceptor_transaction_apply_updates (self, &pages[i], NULL);
 
       if (!rwx_supported)
       {
-        for (cur = addresses; cur != NULL; cur = cur->next)
+        for (i = 0; i != ranges->len; i++)
         {
-          gpointer target_page = cur->data;
+          GumPageRange * range = &g_array_index (ranges, GumPageRange, i);
 
-          gum_mprotect (target_page, page_size, GUM_PAGE_RX);
+          gum_mprotect (range->start, range->size, GUM_PAGE_RX);
         }
       }
 
-      for (cur = addresses; cur != NULL; cur = cur->next)
+      for (i = 0; i != ranges->len; i++)
       {
-        gpointer target_page = cur->data;
+        GumPageRange * range = &g_array_index (ranges, GumPageRange, i);
 
-        gum_clear_cache (target_page, page_size);
+        gum_clear_cache (range->start, range->size);
       }
 
       if (!rwx_supported)
       {
         gpointer raw_id;
 
+        metrics->n_suspended_threads =
+            g_queue_get_length (&suspend_op.suspended_threads);
+
         while (
             (raw_id = g_queue_pop_tail (&suspend_op.suspended_threads)) != NULL)
         {
           gum_thread_resume (GPOINTER_TO_SIZE (raw_id), NULL);
         }
+
+        metrics->suspend_window_us = g_get_monotonic_time () - suspend_start;
+        metrics->max_suspend_window_us = MAX (metrics->max_suspend_window_us,
+            metrics->suspend_window_us);
+        metrics->total_suspend_window_us += metrics->suspend_window_us;
       }
     }
     else
     {
-      guint num_pages;
       GumCodeSegment * segment;
-      guint8 * source_page, * current_page;
+      guint8 * source_page;
       gsize source_offset;
 
-      num_pages = g_hash_table_size (self->pending_update_tasks);
       segment = gum_code_segment_new (num_pages * page_size, NULL);
 
       source_page = gum_code_segment_get_address (segment);
 
-      current_page = source_page;
-      for (cur = addresses; cur != NULL; cur = cur->next)
-      {
-        guint8 * target_page = cur->data;
-
-        memcpy (current_page, target_page, page_size);
-
-        current_page += page_size;
-      }
-
-      for (cur = addresses; cur != NULL; cur = cur->next)
+      for (i = 0; i != num_pages; i++)
       {
-        guint8 * target_page = cur->data;
-        GArray * pending;
-        guint i;
-
-        pending = g_hash_table_lookup (self->pending_update_tasks,
-            target_page);
-        g_assert (pending != NULL);
+        gum_memcpy (source_page, pages[i].page, page_size);
 
-        for (i = 0; i != pending->len; i++)
-        {
-          GumUpdateTask * update;
-
-          update = &g_array_index (pending, GumUpdateTask, i);
-
-          update->func (interceptor, update->ctx, source_page +
-              ((guint8 *) _gum_interceptor_backend_get_function_address (
-                  update->ctx) - target_page));
-        }
+        gum_interceptor_transaction_apply_updates (self, &pages[i],
+            source_page);
 
         source_page += page_size;
       }
@@ -1154,22 +1679,26 @@ gum_interceptor_transaction_end (GumInterceptorTransaction * self)
       gum_code_segment_realize (segment);
 
       source_offset = 0;
-      for (cur = addresses; cur != NULL; cur = cur->next)
+      for (i = 0; i != ranges->len; i++)
       {
-        gpointer target_page = cur->data;
+        GumPageRange * range = &g_array_index (ranges, GumPageRange, i);
 
-        gum_code_segment_map (segment, source_offset, page_size, target_page);
+        gum_code_segment_map (segment, source_offset, range->size,
+            range->start);
 
-        gum_clear_cache (target_page, page_size);
+        gum_clear_cache (range->start, range->size);
 
-        source_offset += page_size;
+        source_offset += range->size;
       }
 
       gum_code_segment_free (segment);
     }
   }
 
-  g_list_free (addresses);
+  g_array_free (ranges, TRUE);
+
+  metrics->n_commits++;
+  metrics->commit_duration_us = g_get_monotonic_time () - commit_start;
 
   {
     GumDestroyTask * task;
@@ -1196,9 +1725,34 @@ gum_interceptor_transaction_end (GumInterceptorTransaction * self)
   gum_interceptor_transaction_destroy (self);
 
 no_changes:
+  gum_interceptor_reclaim (interceptor);
+
   gum_interceptor_unignore_current_thread (interceptor);
 }
 
+static void
+gum_interceptor_transaction_apply_updates (GumInterceptorTransaction * self,
+                                           GumPendingPage * pending,
+                                           guint8 * source_page)
+{
+  GumInterceptor * interceptor = self->interceptor;
+  guint i;
+
+  for (i = 0; i != pending->tasks->len; i++)
+  {
+    GumUpdateTask * update;
+    guint8 * prologue;
+
+    update = &g_array_index (pending->tasks, GumUpdateTask, i);
+
+    prologue = _gum_interceptor_backend_get_function_address (update->ctx);
+    if (source_page != NULL)
+      prologue = source_page + (prologue - (guint8 *) pending->page);
+
+    update->func (interceptor, update->ctx, prologue);
+  }
+}
+
 static gboolean
 gum_maybe_suspend_thread (const GumThreadDetails * details,
                           gpointer user_data)
@@ -1249,38 +1803,159 @@ gum_interceptor_transaction_schedule_update (GumInterceptorTransaction * self,
   end_page = gum_page_address_from_pointer (function_address +
       ctx->overwritten_prologue_len - 1);
 
-  pending = g_hash_table_lookup (self->pending_update_tasks, start_page);
-  if (pending == NULL)
-  {
-    pending = g_array_new (FALSE, FALSE, sizeof (GumUpdateTask));
-    g_hash_table_insert (self->pending_update_tasks, start_page, pending);
-  }
+  pending = gum_interceptor_transaction_get_pending_tasks (self, start_page);
 
   update.ctx = ctx;
   update.func = func;
   g_array_append_val (pending, update);
 
   if (end_page != start_page)
+    gum_interceptor_transaction_get_pending_tasks (self, end_page);
+}
+
+/*
+ * pending_update_tasks is kept sorted by page so the commit can walk it in
+ * order. Instrumenting tends to proceed in address order, so most pages are
+ * either the last one or go after it and never need the binary search.
+ */
+static GArray *
+gum_interceptor_transaction_get_pending_tasks (GumInterceptorTransaction * self,
+                                               gpointer page)
+{
+  GArray * pages = self->pending_update_tasks;
+  GumPendingPage * last, entry;
+  guint lo, hi;
+
+  lo = pages->len;
+
+  if (pages->len != 0)
   {
-    pending = g_hash_table_lookup (self->pending_update_tasks, end_page);
-    if (pending == NULL)
+    last = &g_array_index (pages, GumPendingPage, pages->len - 1);
+    if (last->page == page)
+      return last->tasks;
+
+    if (GPOINTER_TO_SIZE (page) < GPOINTER_TO_SIZE (last->page))
     {
-      pending = g_array_new (FALSE, FALSE, sizeof (GumUpdateTask));
-      g_hash_table_insert (self->pending_update_tasks, end_page, pending);
+      lo = 0;
+      hi = pages->len - 1;
+      while (lo != hi)
+      {
+        guint mid = lo + ((hi - lo) / 2);
+        GumPendingPage * candidate =
+            &g_array_index (pages, GumPendingPage, mid);
+
+        if (candidate->page == page)
+          return candidate->tasks;
+
+        if (GPOINTER_TO_SIZE (candidate->page) < GPOINTER_TO_SIZE (page))
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
     }
   }
+
+  entry.page = page;
+  entry.tasks = g_array_new (FALSE, FALSE, sizeof (GumUpdateTask));
+  g_array_insert_val (pages, lo, entry);
+
+  return entry.tasks;
+}
+
+/*
+ * Listener arrays and entries are only dereferenced while a thread is inside
+ * begin/end_invocation with its guard held, which is when its epoch is
+ * non-zero. Anything retired at epoch E can go once no thread is still inside
+ * an epoch at or before E, without waiting for calls that are merely parked
+ * in the original function.
+ */
+static void
+gum_interceptor_retire (GumInterceptor * self,
+                        GDestroyNotify notify,
+                        gpointer data)
+{
+  GumRetiredTask * task;
+
+  task = g_slice_new (GumRetiredTask);
+  task->notify = notify;
+  task->data = data;
+  task->epoch = g_atomic_int_add (&gum_interceptor_epoch, 1);
+  if (G_UNLIKELY (task->epoch == 0))
+    task->epoch = g_atomic_int_add (&gum_interceptor_epoch, 1);
+
+  g_queue_push_tail (&self->retired_tasks, task);
+}
+
+/*
+ * Called with the lock held. The ready tasks are taken off the queue before
+ * the lock is dropped for their notifies, so that a concurrent retire or
+ * reclaim never sees them.
+ */
+static void
+gum_interceptor_reclaim (GumInterceptor * self)
+{
+  guint oldest_epoch;
+  InterceptorThreadContext * thread_ctx;
+  GQueue ready = G_QUEUE_INIT;
+  GumRetiredTask * task;
+
+  if (g_queue_is_empty (&self->retired_tasks))
+    return;
+
+  oldest_epoch = g_atomic_int_get (&gum_interceptor_epoch);
+
+  for (thread_ctx = g_atomic_pointer_get (&gum_interceptor_thread_contexts);
+      thread_ctx != NULL;
+      thread_ctx = thread_ctx->next)
+  {
+    guint epoch = g_atomic_int_get (&thread_ctx->epoch);
+
+    if (epoch != 0 && GUM_EPOCH_IS_BEFORE (epoch, oldest_epoch))
+      oldest_epoch = epoch;
+  }
+
+  while ((task = g_queue_peek_head (&self->retired_tasks)) != NULL &&
+      GUM_EPOCH_IS_BEFORE (task->epoch, oldest_epoch))
+  {
+    g_queue_push_tail (&ready, g_queue_pop_head (&self->retired_tasks));
+  }
+
+  if (g_queue_is_empty (&ready))
+    return;
+
+  GUM_INTERCEPTOR_UNLOCK (self);
+
+  while ((task = g_queue_pop_head (&ready)) != NULL)
+  {
+    task->notify (task->data);
+
+    g_slice_free (GumRetiredTask, task);
+  }
+
+  GUM_INTERCEPTOR_LOCK (self);
 }
 
 static GumFunctionContext *
 gum_function_context_new (GumInterceptor * interceptor,
                           gpointer function_address,
-                          GumInterceptorType type)
+                          GumInterceptorType type,
+                          GumFunctionContextPool * pool)
 {
   GumFunctionContext * ctx;
 
-  ctx = g_slice_new0 (GumFunctionContext);
+  if (pool != NULL && pool->used != pool->capacity)
+  {
+    ctx = &pool->contexts[pool->used++];
+    ctx->pool = pool;
+    g_atomic_int_inc (&pool->ref_count);
+  }
+  else
+  {
+    ctx = g_slice_new0 (GumFunctionContext);
+  }
   ctx->function_address = function_address;
   ctx->type = type;
+  ctx->telemetry_index = gum_index_pool_acquire (&gum_hook_counters_indices);
   ctx->listener_entries =
       g_ptr_array_new_full (1, (GDestroyNotify) listener_entry_free);
   ctx->interceptor = interceptor;
@@ -1296,7 +1971,12 @@ gum_function_context_finalize (GumFunctionContext * function_ctx)
   g_ptr_array_unref (
       (GPtrArray *) g_atomic_pointer_get (&function_ctx->listener_entries));
 
-  g_slice_free (GumFunctionContext, function_ctx);
+  gum_hook_counters_index_release (function_ctx->telemetry_index);
+
+  if (function_ctx->pool != NULL)
+    gum_function_context_pool_unref (function_ctx->pool);
+  else
+    g_slice_free (GumFunctionContext, function_ctx);
 }
 
 static void
@@ -1337,24 +2017,17 @@ gum_function_context_is_empty (GumFunctionContext * function_ctx)
 }
 
 static void
-gum_function_context_add_listener (GumFunctionContext * function_ctx,
-                                   GumInvocationListener * listener,
-                                   gpointer function_data)
+gum_function_context_add_listeners (GumFunctionContext * function_ctx,
+                                    GumInvocationListener * const * listeners,
+                                    gpointer const * function_data,
+                                    guint n_listeners)
 {
-  ListenerEntry * entry;
   GPtrArray * old_entries, * new_entries;
   guint i;
 
-  entry = g_slice_new (ListenerEntry);
-#ifndef GUM_DIET
-  entry->listener_interface = GUM_INVOCATION_LISTENER_GET_IFACE (listener);
-#endif
-  entry->listener_instance = listener;
-  entry->function_data = function_data;
-
   old_entries =
       (GPtrArray *) g_atomic_pointer_get (&function_ctx->listener_entries);
-  new_entries = g_ptr_array_new_full (old_entries->len + 1,
+  new_entries = g_ptr_array_new_full (old_entries->len + n_listeners,
       (GDestroyNotify) listener_entry_free);
   for (i = 0; i != old_entries->len; i++)
   {
@@ -1362,17 +2035,33 @@ gum_function_context_add_listener (GumFunctionContext * function_ctx,
     if (old_entry != NULL)
       g_ptr_array_add (new_entries, g_slice_dup (ListenerEntry, old_entry));
   }
-  g_ptr_array_add (new_entries, entry);
+
+  for (i = 0; i != n_listeners; i++)
+  {
+    ListenerEntry * entry;
+
+    entry = g_slice_new (ListenerEntry);
+#ifndef GUM_DIET
+    entry->listener_interface =
+        GUM_INVOCATION_LISTENER_GET_IFACE (listeners[i]);
+#endif
+    entry->listener_instance = listeners[i];
+    entry->function_data = (function_data != NULL) ? function_data[i] : NULL;
+    entry->data_index = gum_interceptor_obtain_listener_data_index (
+        function_ctx->interceptor, listeners[i]);
+    g_ptr_array_add (new_entries, entry);
+
+    if (entry->listener_interface->on_leave != NULL)
+    {
+      function_ctx->has_on_leave_listener = TRUE;
+    }
+  }
 
   g_atomic_pointer_set (&function_ctx->listener_entries, new_entries);
-  gum_interceptor_transaction_schedule_destroy (
-      &function_ctx->interceptor->current_transaction, function_ctx,
+  gum_interceptor_retire (function_ctx->interceptor,
       (GDestroyNotify) g_ptr_array_unref, old_entries);
 
-  if (entry->listener_interface->on_leave != NULL)
-  {
-    function_ctx->has_on_leave_listener = TRUE;
-  }
+  gum_function_context_update_dispatch (function_ctx);
 }
 
 static void
@@ -1381,26 +2070,49 @@ listener_entry_free (ListenerEntry * entry)
   g_slice_free (ListenerEntry, entry);
 }
 
+static GumFunctionContextPool *
+gum_function_context_pool_new (guint capacity)
+{
+  GumFunctionContextPool * pool;
+
+  pool = g_malloc0 (sizeof (GumFunctionContextPool) +
+      (capacity * sizeof (GumFunctionContext)));
+  pool->ref_count = 1;
+  pool->capacity = capacity;
+  pool->used = 0;
+
+  return pool;
+}
+
+static void
+gum_function_context_pool_unref (GumFunctionContextPool * pool)
+{
+  if (g_atomic_int_dec_and_test (&pool->ref_count))
+    g_free (pool);
+}
+
 static void
 gum_function_context_remove_listener (GumFunctionContext * function_ctx,
                                       GumInvocationListener * listener)
 {
-  ListenerEntry ** slot;
+  ListenerEntry ** slot, * entry;
   gboolean has_on_leave_listener;
   GPtrArray * listener_entries;
   guint i;
 
   slot = gum_function_context_find_listener (function_ctx, listener);
   g_assert (slot != NULL);
-  listener_entry_free (*slot);
-  *slot = NULL;
+  entry = *slot;
+  g_atomic_pointer_set (slot, NULL);
+  gum_interceptor_retire (function_ctx->interceptor,
+      (GDestroyNotify) listener_entry_free, entry);
 
   has_on_leave_listener = FALSE;
   listener_entries =
       (GPtrArray *) g_atomic_pointer_get (&function_ctx->listener_entries);
   for (i = 0; i != listener_entries->len; i++)
   {
-    ListenerEntry * entry = g_ptr_array_index (listener_entries, i);
+    entry = g_ptr_array_index (listener_entries, i);
     if (entry != NULL && entry->listener_interface->on_leave != NULL)
     {
       has_on_leave_listener = TRUE;
@@ -1408,6 +2120,8 @@ gum_function_context_remove_listener (GumFunctionContext * function_ctx,
     }
   }
   function_ctx->has_on_leave_listener = has_on_leave_listener;
+
+  gum_function_context_update_dispatch (function_ctx);
 }
 
 static gboolean
@@ -1468,6 +2182,8 @@ _gum_function_context_begin_invocation (GumFunctionContext * function_ctx,
   GumInvocationStack * stack;
   GumInvocationStackEntry * stack_entry;
   GumInvocationContext * invocation_ctx = NULL;
+  GumHookCounters * counters;
+  guint64 sample_start = 0;
   gint system_error;
   gboolean invoke_listeners = TRUE;
   gboolean will_trap_on_leave;
@@ -1480,14 +2196,20 @@ _gum_function_context_begin_invocation (GumFunctionContext * function_ctx,
   system_error = gum_thread_get_system_error ();
 #endif
 
-  if (gum_tls_key_get_value (gum_interceptor_guard_key) == interceptor)
+  interceptor_ctx = get_interceptor_thread_context ();
+  if (interceptor_ctx->guard == interceptor ||
+      interceptor_ctx == &gum_interceptor_bootstrap_context)
   {
+    gum_hook_counter_add (&interceptor_thread_context_peek_counters (
+        interceptor_ctx, function_ctx->telemetry_index)->guard_bypasses, 1);
     *next_hop = function_ctx->on_invoke_trampoline;
     goto bypass;
   }
-  gum_tls_key_set_value (gum_interceptor_guard_key, interceptor);
+  interceptor_thread_context_enter (interceptor_ctx, interceptor);
+
+  counters = interceptor_thread_context_get_counters (interceptor_ctx,
+      function_ctx->telemetry_index);
 
-  interceptor_ctx = get_interceptor_thread_context ();
   stack = interceptor_ctx->stack;
 
   stack_entry = gum_invocation_stack_peek_top (stack);
@@ -1497,7 +2219,8 @@ _gum_function_context_begin_invocation (GumFunctionContext * function_ctx,
           stack_entry->invocation_context.function)) ==
           function_ctx->function_address)
   {
-    gum_tls_key_set_value (gum_interceptor_guard_key, NULL);
+    gum_hook_counter_add (&counters->guard_bypasses, 1);
+    interceptor_thread_context_leave (interceptor_ctx);
     *next_hop = function_ctx->on_invoke_trampoline;
     goto bypass;
   }
@@ -1506,6 +2229,32 @@ _gum_function_context_begin_invocation (GumFunctionContext * function_ctx,
   system_error = gum_thread_get_system_error ();
 #endif
 
+  gum_hook_counter_add (&counters->calls, 1);
+  if (G_UNLIKELY (interceptor->latency_sample_rate != 0))
+  {
+    sample_start = interceptor_thread_context_maybe_sample (interceptor_ctx,
+        interceptor->latency_sample_rate);
+  }
+
+  switch (g_atomic_int_get (&function_ctx->dispatch))
+  {
+    case GUM_DISPATCH_SINGLE_ENTER:
+      if (gum_function_context_begin_single_enter (function_ctx,
+          interceptor_ctx, cpu_context, system_error, next_hop))
+        goto invoked;
+      break;
+    case GUM_DISPATCH_REPLACEMENT_ONLY:
+      if (function_ctx->replacement_function != NULL)
+      {
+        gum_function_context_begin_replacement (function_ctx, interceptor_ctx,
+            cpu_context, caller_ret_addr, system_error, next_hop);
+        goto invoked;
+      }
+      break;
+    default:
+      break;
+  }
+
   if (interceptor->selected_thread_id != 0)
   {
     invoke_listeners =
@@ -1517,17 +2266,20 @@ _gum_function_context_begin_invocation (GumFunctionContext * function_ctx,
     invoke_listeners = (interceptor_ctx->ignore_level <= 0);
   }
 
+  if (!invoke_listeners)
+    gum_hook_counter_add (&counters->ignored_calls, 1);
+
   will_trap_on_leave = function_ctx->replacement_function != NULL ||
       (invoke_listeners && function_ctx->has_on_leave_listener);
   if (will_trap_on_leave)
   {
-    stack_entry = gum_invocation_stack_push (stack, function_ctx,
+    stack_entry = gum_invocation_stack_push (interceptor_ctx, function_ctx,
         *caller_ret_addr);
     invocation_ctx = &stack_entry->invocation_context;
   }
   else if (invoke_listeners)
   {
-    stack_entry = gum_invocation_stack_push (stack, function_ctx,
+    stack_entry = gum_invocation_stack_push (interceptor_ctx, function_ctx,
         function_ctx->function_address);
     invocation_ctx = &stack_entry->invocation_context;
   }
@@ -1559,7 +2311,8 @@ _gum_function_context_begin_invocation (GumFunctionContext * function_ctx,
       state.point_cut = GUM_POINT_ENTER;
       state.entry = listener_entry;
       state.interceptor_ctx = interceptor_ctx;
-      state.invocation_data = stack_entry->listener_invocation_data[i];
+      state.stack_entry = stack_entry;
+      state.listener_index = i;
       invocation_ctx->backend->data = &state;
 
 #ifndef GUM_DIET
@@ -1584,7 +2337,7 @@ _gum_function_context_begin_invocation (GumFunctionContext * function_ctx,
 
   gum_thread_set_system_error (system_error);
 
-  gum_tls_key_set_value (gum_interceptor_guard_key, NULL);
+  interceptor_thread_context_leave (interceptor_ctx);
 
   if (will_trap_on_leave)
   {
@@ -1612,12 +2365,151 @@ _gum_function_context_begin_invocation (GumFunctionContext * function_ctx,
     g_atomic_int_dec_and_test (&function_ctx->trampoline_usage_counter);
   }
 
+invoked:
+  if (sample_start != 0)
+  {
+    gum_hook_counter_add (&counters->enter_cycles,
+        gum_read_cycle_counter () - sample_start);
+    gum_hook_counter_add (&counters->enter_samples, 1);
+  }
+
   return;
 
 bypass:
   g_atomic_int_dec_and_test (&function_ctx->trampoline_usage_counter);
 }
 
+static void
+gum_function_context_update_dispatch (GumFunctionContext * function_ctx)
+{
+  GumDispatchKind dispatch = GUM_DISPATCH_GENERIC;
+  GPtrArray * listener_entries;
+
+  listener_entries =
+      (GPtrArray *) g_atomic_pointer_get (&function_ctx->listener_entries);
+
+  if (function_ctx->replacement_function != NULL)
+  {
+    if (gum_function_context_find_taken_listener_slot (function_ctx) == NULL)
+      dispatch = GUM_DISPATCH_REPLACEMENT_ONLY;
+  }
+  else if (listener_entries->len == 1)
+  {
+    ListenerEntry * entry = g_ptr_array_index (listener_entries, 0);
+
+    if (entry != NULL && entry->listener_interface->on_enter != NULL &&
+        entry->listener_interface->on_leave == NULL)
+    {
+      dispatch = GUM_DISPATCH_SINGLE_ENTER;
+    }
+  }
+
+  g_atomic_int_set (&function_ctx->dispatch, dispatch);
+}
+
+static gboolean
+gum_function_context_begin_single_enter (
+    GumFunctionContext * function_ctx,
+    InterceptorThreadContext * interceptor_ctx,
+    GumCpuContext * cpu_context,
+    gint system_error,
+    gpointer * next_hop)
+{
+  GPtrArray * listener_entries;
+  ListenerEntry * listener_entry;
+  GumInvocationStackEntry * stack_entry;
+  GumInvocationContext * invocation_ctx;
+  ListenerInvocationState state;
+
+  listener_entries =
+      (GPtrArray *) g_atomic_pointer_get (&function_ctx->listener_entries);
+  if (listener_entries->len != 1 ||
+      function_ctx->replacement_function != NULL ||
+      function_ctx->interceptor->selected_thread_id != 0 ||
+      interceptor_ctx->ignore_level > 0)
+  {
+    return FALSE;
+  }
+
+  listener_entry = g_ptr_array_index (listener_entries, 0);
+  if (listener_entry == NULL)
+    return FALSE;
+
+  stack_entry = gum_invocation_stack_push (interceptor_ctx, function_ctx,
+      function_ctx->function_address);
+  invocation_ctx = &stack_entry->invocation_context;
+  invocation_ctx->system_error = system_error;
+
+  gum_function_context_fixup_cpu_context (function_ctx, cpu_context);
+
+  invocation_ctx->cpu_context = cpu_context;
+  invocation_ctx->backend = &interceptor_ctx->listener_backend;
+
+  state.point_cut = GUM_POINT_ENTER;
+  state.entry = listener_entry;
+  state.interceptor_ctx = interceptor_ctx;
+  state.stack_entry = stack_entry;
+  state.listener_index = 0;
+  invocation_ctx->backend->data = &state;
+
+#ifndef GUM_DIET
+  listener_entry->listener_interface->on_enter (
+      listener_entry->listener_instance, invocation_ctx);
+#else
+  gum_invocation_listener_on_enter (listener_entry->listener_instance,
+      invocation_ctx);
+#endif
+
+  system_error = invocation_ctx->system_error;
+
+  gum_invocation_stack_pop (interceptor_ctx->stack);
+
+  gum_thread_set_system_error (system_error);
+
+  interceptor_thread_context_leave (interceptor_ctx);
+
+  *next_hop = function_ctx->on_invoke_trampoline;
+
+  g_atomic_int_dec_and_test (&function_ctx->trampoline_usage_counter);
+
+  return TRUE;
+}
+
+static void
+gum_function_context_begin_replacement (
+    GumFunctionContext * function_ctx,
+    InterceptorThreadContext * interceptor_ctx,
+    GumCpuContext * cpu_context,
+    gpointer * caller_ret_addr,
+    gint system_error,
+    gpointer * next_hop)
+{
+  GumInvocationStackEntry * stack_entry;
+  GumInvocationContext * invocation_ctx;
+
+  stack_entry = gum_invocation_stack_push (interceptor_ctx, function_ctx,
+      *caller_ret_addr);
+  invocation_ctx = &stack_entry->invocation_context;
+  invocation_ctx->system_error = system_error;
+
+  gum_function_context_fixup_cpu_context (function_ctx, cpu_context);
+
+  gum_thread_set_system_error (system_error);
+
+  interceptor_thread_context_leave (interceptor_ctx);
+
+  *caller_ret_addr = function_ctx->on_leave_trampoline;
+
+  stack_entry->calling_replacement = TRUE;
+  stack_entry->cpu_context = *cpu_context;
+  stack_entry->original_system_error = system_error;
+  invocation_ctx->cpu_context = &stack_entry->cpu_context;
+  invocation_ctx->backend = &interceptor_ctx->replacement_backend;
+  invocation_ctx->backend->data = function_ctx->replacement_data;
+
+  *next_hop = function_ctx->replacement_function;
+}
+
 void
 _gum_function_context_end_invocation (GumFunctionContext * function_ctx,
                                       GumCpuContext * cpu_context,
@@ -1628,20 +2520,28 @@ _gum_function_context_end_invocation (GumFunctionContext * function_ctx,
   GumInvocationStackEntry * stack_entry;
   GumInvocationContext * invocation_ctx;
   GPtrArray * listener_entries;
+  guint sample_rate;
+  guint64 sample_start = 0;
   guint i;
 
 #ifdef HAVE_WINDOWS
   system_error = gum_thread_get_system_error ();
 #endif
 
-  gum_tls_key_set_value (gum_interceptor_guard_key, function_ctx->interceptor);
+  interceptor_ctx = get_interceptor_thread_context ();
+  interceptor_thread_context_enter (interceptor_ctx, function_ctx->interceptor);
+
+  sample_rate = function_ctx->interceptor->latency_sample_rate;
+  if (G_UNLIKELY (sample_rate != 0))
+  {
+    sample_start =
+        interceptor_thread_context_maybe_sample (interceptor_ctx, sample_rate);
+  }
 
 #ifndef HAVE_WINDOWS
   system_error = gum_thread_get_system_error ();
 #endif
 
-  interceptor_ctx = get_interceptor_thread_context ();
-
   stack_entry = gum_invocation_stack_peek_top (interceptor_ctx->stack);
   *next_hop = gum_sign_code_pointer (stack_entry->caller_ret_addr);
 
@@ -1674,7 +2574,8 @@ _gum_function_context_end_invocation (GumFunctionContext * function_ctx,
     state.point_cut = GUM_POINT_LEAVE;
     state.entry = listener_entry;
     state.interceptor_ctx = interceptor_ctx;
-    state.invocation_data = stack_entry->listener_invocation_data[i];
+    state.stack_entry = stack_entry;
+    state.listener_index = i;
     invocation_ctx->backend->data = &state;
 
 #ifndef GUM_DIET
@@ -1693,7 +2594,17 @@ _gum_function_context_end_invocation (GumFunctionContext * function_ctx,
 
   gum_invocation_stack_pop (interceptor_ctx->stack);
 
-  gum_tls_key_set_value (gum_interceptor_guard_key, NULL);
+  if (sample_start != 0)
+  {
+    GumHookCounters * counters = interceptor_thread_context_get_counters (
+        interceptor_ctx, function_ctx->telemetry_index);
+
+    gum_hook_counter_add (&counters->leave_cycles,
+        gum_read_cycle_counter () - sample_start);
+    gum_hook_counter_add (&counters->leave_samples, 1);
+  }
+
+  interceptor_thread_context_leave (interceptor_ctx);
 
   g_atomic_int_dec_and_test (&function_ctx->trampoline_usage_counter);
 }
@@ -1726,40 +2637,361 @@ gum_function_context_fixup_cpu_context (GumFunctionContext * function_ctx,
 #endif
 }
 
-static InterceptorThreadContext *
-get_interceptor_thread_context (void)
+static void
+gum_function_context_collect_statistics (GumFunctionContext * function_ctx,
+                                         GumHookStatistics * stats)
 {
-  InterceptorThreadContext * context;
+  guint index = function_ctx->telemetry_index;
+  guint generation;
+  InterceptorThreadContext * thread_ctx;
+
+  stats->function_address = function_ctx->function_address;
 
-  context = g_private_get (&gum_interceptor_context_private);
-  if (context == NULL)
+  if (index == 0)
+    return;
+
+  generation = g_atomic_int_get (&gum_hook_counters_generations[index]);
+
+  for (thread_ctx = g_atomic_pointer_get (&gum_interceptor_thread_contexts);
+      thread_ctx != NULL;
+      thread_ctx = thread_ctx->next)
   {
-    context = interceptor_thread_context_new ();
+    GumHookCounters * chunk, * counters;
 
-    gum_spinlock_acquire (&gum_interceptor_thread_context_lock);
-    g_hash_table_add (gum_interceptor_thread_contexts, context);
-    gum_spinlock_release (&gum_interceptor_thread_context_lock);
+    chunk = g_atomic_pointer_get (
+        &thread_ctx->counters[index / GUM_HOOK_COUNTERS_CHUNK_SIZE]);
+    if (chunk == NULL)
+      continue;
+    counters = &chunk[index % GUM_HOOK_COUNTERS_CHUNK_SIZE];
+    if (g_atomic_int_get (&counters->generation) != generation)
+      continue;
 
-    g_private_set (&gum_interceptor_context_private, context);
+    stats->calls += gum_hook_counter_get (&counters->calls);
+    stats->guard_bypasses += gum_hook_counter_get (&counters->guard_bypasses);
+    stats->ignored_calls += gum_hook_counter_get (&counters->ignored_calls);
+    stats->enter_samples += gum_hook_counter_get (&counters->enter_samples);
+    stats->enter_cycles += gum_hook_counter_get (&counters->enter_cycles);
+    stats->leave_samples += gum_hook_counter_get (&counters->leave_samples);
+    stats->leave_cycles += gum_hook_counter_get (&counters->leave_cycles);
   }
-
-  return context;
 }
 
+/*
+ * The counters themselves are left alone: other threads may still be
+ * writing them. Moving the generation on makes readers skip them and has
+ * each owner clear its block before the index's next function counts.
+ */
 static void
-release_interceptor_thread_context (InterceptorThreadContext * context)
+gum_hook_counters_index_release (guint index)
 {
-  if (gum_interceptor_thread_contexts == NULL)
+  if (index == 0)
     return;
 
-  gum_spinlock_acquire (&gum_interceptor_thread_context_lock);
-  g_hash_table_remove (gum_interceptor_thread_contexts, context);
-  gum_spinlock_release (&gum_interceptor_thread_context_lock);
+  g_atomic_int_inc (&gum_hook_counters_generations[index]);
+
+  gum_index_pool_release (&gum_hook_counters_indices, index);
 }
 
-static GumPointCut
-gum_interceptor_invocation_get_listener_point_cut (
-    GumInvocationContext * context)
+/* Called by the owning thread only. */
+static void
+gum_hook_counters_refresh (GumHookCounters * counters,
+                           guint index)
+{
+  guint generation;
+
+  generation = g_atomic_int_get (&gum_hook_counters_generations[index]);
+  if (G_LIKELY (counters->generation == generation))
+    return;
+
+  gum_hook_counter_set (&counters->calls, 0);
+  gum_hook_counter_set (&counters->guard_bypasses, 0);
+  gum_hook_counter_set (&counters->ignored_calls, 0);
+  gum_hook_counter_set (&counters->enter_samples, 0);
+  gum_hook_counter_set (&counters->enter_cycles, 0);
+  gum_hook_counter_set (&counters->leave_samples, 0);
+  gum_hook_counter_set (&counters->leave_cycles, 0);
+
+  g_atomic_int_set (&counters->generation, generation);
+}
+
+/*
+ * Counters have a single writer, so an add is a whole load followed by a
+ * whole store rather than an atomic read-modify-write. Only 32-bit MSVC
+ * has no plain 64-bit atomic access and has to go through a CAS.
+ */
+static guint64
+gum_hook_counter_get (guint64 * counter)
+{
+#if defined (__GNUC__)
+  return __atomic_load_n (counter, __ATOMIC_RELAXED);
+#elif GLIB_SIZEOF_VOID_P == 8
+  return *(volatile guint64 *) counter;
+#else
+  return _InterlockedCompareExchange64 ((volatile __int64 *) counter, 0, 0);
+#endif
+}
+
+static void
+gum_hook_counter_set (guint64 * counter,
+                      guint64 value)
+{
+#if defined (__GNUC__)
+  __atomic_store_n (counter, value, __ATOMIC_RELAXED);
+#elif GLIB_SIZEOF_VOID_P == 8
+  *(volatile guint64 *) counter = value;
+#else
+  __int64 old_value;
+
+  do
+    old_value = *(volatile __int64 *) counter;
+  while (_InterlockedCompareExchange64 ((volatile __int64 *) counter, value,
+      old_value) != old_value);
+#endif
+}
+
+static void
+gum_hook_counter_add (guint64 * counter,
+                      guint64 delta)
+{
+  gum_hook_counter_set (counter, gum_hook_counter_get (counter) + delta);
+}
+
+static guint
+gum_interceptor_obtain_listener_data_index (GumInterceptor * self,
+                                            GumInvocationListener * listener)
+{
+  guint index;
+
+  index = GPOINTER_TO_UINT (
+      g_hash_table_lookup (self->listener_data_indices, listener));
+  if (index == 0)
+  {
+    index = gum_index_pool_acquire (&gum_listener_data_indices);
+    if (index != 0)
+    {
+      g_hash_table_insert (self->listener_data_indices, listener,
+          GUINT_TO_POINTER (index));
+    }
+  }
+
+  return index;
+}
+
+static void
+gum_listener_data_index_release (gpointer index)
+{
+  guint i = GPOINTER_TO_UINT (index);
+
+  g_atomic_int_inc (&gum_listener_data_generations[i]);
+
+  gum_index_pool_release (&gum_listener_data_indices, i);
+}
+
+static guint
+gum_index_pool_acquire (GumIndexPool * self)
+{
+  guint index = 0;
+
+  g_mutex_lock (&self->mutex);
+
+  if (self->free_indices != NULL && self->free_indices->len != 0)
+  {
+    index = g_array_index (self->free_indices, guint,
+        self->free_indices->len - 1);
+    g_array_set_size (self->free_indices, self->free_indices->len - 1);
+  }
+  else if (self->next_index != self->limit)
+  {
+    index = self->next_index++;
+  }
+
+  g_mutex_unlock (&self->mutex);
+
+  return index;
+}
+
+static void
+gum_index_pool_release (GumIndexPool * self,
+                        guint index)
+{
+  g_mutex_lock (&self->mutex);
+
+  if (self->free_indices == NULL)
+    self->free_indices = g_array_new (FALSE, FALSE, sizeof (guint));
+  g_array_append_val (self->free_indices, index);
+
+  g_mutex_unlock (&self->mutex);
+}
+
+static guint64
+gum_read_cycle_counter (void)
+{
+#if defined (HAVE_I386) && defined (_MSC_VER)
+  return __rdtsc ();
+#elif defined (HAVE_I386)
+  return __builtin_ia32_rdtsc ();
+#elif defined (HAVE_ARM64) && !defined (_MSC_VER)
+  guint64 value;
+
+  asm volatile ("mrs %0, cntvct_el0" : "=r" (value));
+
+  return value;
+#else
+  return g_get_monotonic_time ();
+#endif
+}
+
+static InterceptorThreadContext *
+get_interceptor_thread_context (void)
+{
+  InterceptorThreadContext * context;
+
+  context = gum_tls_key_get_value (gum_interceptor_context_key);
+  if (G_UNLIKELY (context == NULL))
+    context = obtain_interceptor_thread_context ();
+
+  return context;
+}
+
+static InterceptorThreadContext *
+obtain_interceptor_thread_context (void)
+{
+  InterceptorThreadContext * context, * head;
+
+  /*
+   * Anything hooked that we end up calling below sees the bootstrap context
+   * and bypasses its listeners, just like a guarded call.
+   */
+  gum_tls_key_set_value (gum_interceptor_context_key,
+      &gum_interceptor_bootstrap_context);
+
+  for (context = g_atomic_pointer_get (&gum_interceptor_thread_contexts);
+      context != NULL;
+      context = context->next)
+  {
+    if (g_atomic_int_compare_and_exchange (&context->in_use, FALSE, TRUE))
+      break;
+  }
+
+  if (context != NULL)
+  {
+    context->guard = NULL;
+    context->epoch = 0;
+    context->ignore_level = 0;
+    g_array_set_size (context->stack, 0);
+    interceptor_thread_context_free_listener_data (context);
+  }
+  else
+  {
+    context = interceptor_thread_context_new ();
+
+    do
+    {
+      head = g_atomic_pointer_get (&gum_interceptor_thread_contexts);
+      context->next = head;
+    }
+    while (!g_atomic_pointer_compare_and_exchange (
+        &gum_interceptor_thread_contexts, head, context));
+  }
+
+  g_private_set (&gum_interceptor_context_private, context);
+
+  gum_tls_key_set_value (gum_interceptor_context_key, context);
+
+  return context;
+}
+
+static void
+interceptor_thread_context_enter (InterceptorThreadContext * self,
+                                  GumInterceptor * interceptor)
+{
+  guint epoch;
+
+  self->guard = interceptor;
+
+  epoch = g_atomic_int_get (&gum_interceptor_epoch);
+  if (G_UNLIKELY (epoch == 0))
+    epoch = 1;
+  g_atomic_int_set (&self->epoch, epoch);
+}
+
+static void
+interceptor_thread_context_leave (InterceptorThreadContext * self)
+{
+  g_atomic_int_set (&self->epoch, 0);
+  self->guard = NULL;
+}
+
+static GumHookCounters *
+interceptor_thread_context_get_counters (InterceptorThreadContext * self,
+                                         guint index)
+{
+  GumHookCounters * volatile * slot;
+  GumHookCounters * chunk, * counters;
+
+  slot = &self->counters[index / GUM_HOOK_COUNTERS_CHUNK_SIZE];
+  chunk = *slot;
+  if (G_UNLIKELY (chunk == NULL))
+  {
+    chunk = g_new0 (GumHookCounters, GUM_HOOK_COUNTERS_CHUNK_SIZE);
+    g_atomic_pointer_set (slot, chunk);
+  }
+
+  counters = &chunk[index % GUM_HOOK_COUNTERS_CHUNK_SIZE];
+  gum_hook_counters_refresh (counters, index);
+
+  return counters;
+}
+
+/*
+ * For the guard bypass path, where allocating could recurse back into it:
+ * counts only land if the chunk already exists.
+ */
+static GumHookCounters *
+interceptor_thread_context_peek_counters (InterceptorThreadContext * self,
+                                          guint index)
+{
+  GumHookCounters * chunk, * counters;
+
+  chunk = self->counters[index / GUM_HOOK_COUNTERS_CHUNK_SIZE];
+  if (G_UNLIKELY (chunk == NULL))
+    return &gum_hook_counters_discarded;
+
+  counters = &chunk[index % GUM_HOOK_COUNTERS_CHUNK_SIZE];
+  gum_hook_counters_refresh (counters, index);
+
+  return counters;
+}
+
+static guint64
+interceptor_thread_context_maybe_sample (InterceptorThreadContext * self,
+                                         guint rate)
+{
+  if (self->sample_countdown > 1)
+  {
+    self->sample_countdown--;
+    return 0;
+  }
+
+  self->sample_countdown = rate;
+
+  return gum_read_cycle_counter ();
+}
+
+static void
+release_interceptor_thread_context (InterceptorThreadContext * context)
+{
+  if (!gum_interceptor_thread_contexts_active)
+    return;
+
+  gum_tls_key_set_value (gum_interceptor_context_key, NULL);
+
+  g_atomic_int_set (&context->in_use, FALSE);
+}
+
+static GumPointCut
+gum_interceptor_invocation_get_listener_point_cut (
+    GumInvocationContext * context)
 {
   return ((ListenerInvocationState *) context->backend->data)->point_cut;
 }
@@ -1795,7 +3027,7 @@ gum_interceptor_invocation_get_listener_thread_data (
       (ListenerInvocationState *) context->backend->data;
 
   return interceptor_thread_context_get_listener_data (data->interceptor_ctx,
-      data->entry->listener_instance, required_size);
+      data->entry->data_index, required_size);
 }
 
 static gpointer
@@ -1818,7 +3050,8 @@ gum_interceptor_invocation_get_listener_invocation_data (
   if (required_size > GUM_MAX_LISTENER_DATA)
     return NULL;
 
-  return data->invocation_data;
+  return interceptor_thread_context_get_invocation_data (data->interceptor_ctx,
+      data->stack_entry, data->listener_index);
 }
 
 static gpointer
@@ -1879,13 +3112,18 @@ interceptor_thread_context_new (void)
   context->listener_backend.state = context;
   context->replacement_backend.state = context;
 
+  context->guard = NULL;
+  context->epoch = 0;
   context->ignore_level = 0;
 
-  context->stack = g_array_sized_new (FALSE, TRUE,
+  context->stack = g_array_sized_new (FALSE, FALSE,
       sizeof (GumInvocationStackEntry), GUM_MAX_CALL_DEPTH);
+  context->stack_capacity = GUM_MAX_CALL_DEPTH;
 
-  context->listener_data_slots = g_array_sized_new (FALSE, TRUE,
-      sizeof (ListenerDataSlot), GUM_MAX_LISTENERS_PER_FUNCTION);
+  context->invocation_data = g_ptr_array_new_with_free_func (g_free);
+
+  context->in_use = TRUE;
+  context->next = NULL;
 
   return context;
 }
@@ -1893,7 +3131,14 @@ interceptor_thread_context_new (void)
 static void
 interceptor_thread_context_destroy (InterceptorThreadContext * context)
 {
-  g_array_free (context->listener_data_slots, TRUE);
+  guint i;
+
+  for (i = 0; i != GUM_HOOK_COUNTERS_MAX_CHUNKS; i++)
+    g_free (context->counters[i]);
+
+  g_ptr_array_unref (context->invocation_data);
+
+  interceptor_thread_context_free_listener_data (context);
 
   g_array_free (context->stack, TRUE);
 
@@ -1902,76 +3147,116 @@ interceptor_thread_context_destroy (InterceptorThreadContext * context)
 
 static gpointer
 interceptor_thread_context_get_listener_data (InterceptorThreadContext * self,
-                                              GumInvocationListener * listener,
+                                              guint index,
                                               gsize required_size)
 {
-  guint i;
-  ListenerDataSlot * available_slot = NULL;
+  ListenerDataSlot ** chunk, * slot;
+  guint generation;
 
-  if (required_size > GUM_MAX_LISTENER_DATA)
+  if (required_size > GUM_MAX_LISTENER_DATA || index == 0)
     return NULL;
 
-  for (i = 0; i != self->listener_data_slots->len; i++)
-  {
-    ListenerDataSlot * slot;
+  chunk = &self->listener_data[index / GUM_LISTENER_DATA_CHUNK_SIZE];
+  if (*chunk == NULL)
+    *chunk = g_new0 (ListenerDataSlot, GUM_LISTENER_DATA_CHUNK_SIZE);
+  slot = &(*chunk)[index % GUM_LISTENER_DATA_CHUNK_SIZE];
 
-    slot = &g_array_index (self->listener_data_slots, ListenerDataSlot, i);
-    if (slot->owner == listener)
-      return slot->data;
-    else if (slot->owner == NULL)
-      available_slot = slot;
+  generation = g_atomic_int_get (&gum_listener_data_generations[index]);
+  if (slot->generation != generation)
+  {
+    gum_memset (slot->data, 0, sizeof (slot->data));
+    slot->generation = generation;
   }
 
-  if (available_slot == NULL)
+  return slot->data;
+}
+
+static void
+interceptor_thread_context_free_listener_data (InterceptorThreadContext * self)
+{
+  guint i;
+
+  for (i = 0; i != GUM_LISTENER_DATA_MAX_CHUNKS; i++)
   {
-    g_array_set_size (self->listener_data_slots,
-        self->listener_data_slots->len + 1);
-    available_slot = &g_array_index (self->listener_data_slots,
-        ListenerDataSlot, self->listener_data_slots->len - 1);
+    g_free (self->listener_data[i]);
+    self->listener_data[i] = NULL;
   }
-  else
+}
+
+/*
+ * Invocation data is the bulk of what a stack entry used to carry, and most
+ * listeners never ask for it. It lives in one row per depth, allocated the
+ * first time a listener at that depth asks, and is zeroed per invocation only
+ * for the listeners that do.
+ */
+static gpointer
+interceptor_thread_context_get_invocation_data (
+    InterceptorThreadContext * self,
+    GumInvocationStackEntry * entry,
+    guint listener_index)
+{
+  guint depth, bit;
+  guint8 * row, * data;
+
+  if (listener_index >= GUM_MAX_LISTENERS_PER_FUNCTION)
+    return NULL;
+
+  depth = entry - (GumInvocationStackEntry *) self->stack->data;
+  if (depth >= self->invocation_data->len)
+    g_ptr_array_set_size (self->invocation_data, depth + 1);
+
+  row = g_ptr_array_index (self->invocation_data, depth);
+  if (row == NULL)
   {
-    gum_memset (available_slot->data, 0, sizeof (available_slot->data));
+    row = g_malloc (GUM_MAX_LISTENERS_PER_FUNCTION * GUM_MAX_LISTENER_DATA);
+    g_ptr_array_index (self->invocation_data, depth) = row;
   }
 
-  available_slot->owner = listener;
+  data = row + (listener_index * GUM_MAX_LISTENER_DATA);
+
+  bit = 1U << listener_index;
+  if ((entry->invocation_data_mask & bit) == 0)
+  {
+    gum_memset (data, 0, GUM_MAX_LISTENER_DATA);
+    entry->invocation_data_mask |= bit;
+  }
 
-  return available_slot->data;
+  return data;
 }
 
 static void
-interceptor_thread_context_forget_listener_data (
-    InterceptorThreadContext * self,
-    GumInvocationListener * listener)
+interceptor_thread_context_grow_stack (InterceptorThreadContext * self)
 {
-  guint i;
+  GumInvocationStack * stack = self->stack;
+  guint len = stack->len;
 
-  for (i = 0; i != self->listener_data_slots->len; i++)
-  {
-    ListenerDataSlot * slot;
-
-    slot = &g_array_index (self->listener_data_slots, ListenerDataSlot, i);
-    if (slot->owner == listener)
-    {
-      slot->owner = NULL;
-      return;
-    }
-  }
+  self->stack_capacity *= 2;
+  g_array_set_size (stack, self->stack_capacity);
+  g_array_set_size (stack, len);
 }
 
+/*
+ * The stack's storage is reserved up front and never cleared, so push and pop
+ * only move len. Every field the hot path reads is written here.
+ */
 static GumInvocationStackEntry *
-gum_invocation_stack_push (GumInvocationStack * stack,
+gum_invocation_stack_push (InterceptorThreadContext * context,
                            GumFunctionContext * function_ctx,
                            gpointer caller_ret_addr)
 {
+  GumInvocationStack * stack = context->stack;
   GumInvocationStackEntry * entry;
   GumInvocationContext * ctx;
 
-  g_array_set_size (stack, stack->len + 1);
-  entry = (GumInvocationStackEntry *)
-      &g_array_index (stack, GumInvocationStackEntry, stack->len - 1);
+  if (G_UNLIKELY (stack->len == context->stack_capacity))
+    interceptor_thread_context_grow_stack (context);
+
+  entry = &g_array_index (stack, GumInvocationStackEntry, stack->len);
+  stack->len++;
   entry->function_ctx = function_ctx;
   entry->caller_ret_addr = caller_ret_addr;
+  entry->calling_replacement = FALSE;
+  entry->invocation_data_mask = 0;
 
   ctx = &entry->invocation_context;
   ctx->function = gum_sign_code_pointer (function_ctx->function_address);
@@ -1985,14 +3270,11 @@ static gpointer
 gum_invocation_stack_pop (GumInvocationStack * stack)
 {
   GumInvocationStackEntry * entry;
-  gpointer caller_ret_addr;
 
-  entry = (GumInvocationStackEntry *)
-      &g_array_index (stack, GumInvocationStackEntry, stack->len - 1);
-  caller_ret_addr = entry->caller_ret_addr;
-  g_array_set_size (stack, stack->len - 1);
+  stack->len--;
+  entry = &g_array_index (stack, GumInvocationStackEntry, stack->len);
 
-  return caller_ret_addr;
+  return entry->caller_ret_addr;
 }
 
 static GumInvocationStackEntry *
@@ -2034,10 +3316,201 @@ static gboolean
 gum_interceptor_has (GumInterceptor * self,
                      gpointer function_address)
 {
-  return g_hash_table_lookup (self->function_by_address,
+  return gum_address_index_lookup (&self->function_by_address,
       function_address) != NULL;
 }
 
+static void
+gum_address_index_init (GumAddressIndex * self)
+{
+  self->slots = NULL;
+  self->capacity = 0;
+  self->size = 0;
+}
+
+static void
+gum_address_index_clear (GumAddressIndex * self,
+                         GDestroyNotify notify)
+{
+  GumAddressIndexSlot * slots = self->slots;
+  guint capacity = self->capacity;
+  guint i;
+
+  gum_address_index_init (self);
+
+  if (notify != NULL)
+  {
+    for (i = 0; i != capacity; i++)
+    {
+      if (slots[i].address != NULL)
+        notify (slots[i].value);
+    }
+  }
+
+  g_free (slots);
+}
+
+static gpointer
+gum_address_index_lookup (GumAddressIndex * self,
+                          gpointer address)
+{
+  gint i;
+
+  i = gum_address_index_find (self, address);
+  if (i == -1)
+    return NULL;
+
+  return self->slots[i].value;
+}
+
+static void
+gum_address_index_insert (GumAddressIndex * self,
+                          gpointer address,
+                          gpointer value)
+{
+  if ((self->size + 1) * 4 > self->capacity * 3)
+  {
+    GumAddressIndexSlot * old_slots = self->slots;
+    guint old_capacity = self->capacity;
+    guint i;
+
+    self->capacity = (old_capacity != 0)
+        ? old_capacity * 2
+        : GUM_ADDRESS_INDEX_INITIAL_CAPACITY;
+    self->slots = g_new0 (GumAddressIndexSlot, self->capacity);
+
+    for (i = 0; i != old_capacity; i++)
+    {
+      if (old_slots[i].address != NULL)
+      {
+        gum_address_index_place (self, old_slots[i].address,
+            old_slots[i].value);
+      }
+    }
+
+    g_free (old_slots);
+  }
+
+  gum_address_index_place (self, address, value);
+  self->size++;
+}
+
+static gpointer
+gum_address_index_remove (GumAddressIndex * self,
+                          gpointer address)
+{
+  gint i;
+  gpointer value;
+
+  i = gum_address_index_find (self, address);
+  if (i == -1)
+    return NULL;
+
+  value = self->slots[i].value;
+  gum_address_index_remove_at (self, i);
+
+  return value;
+}
+
+static void
+gum_address_index_remove_at (GumAddressIndex * self,
+                             guint i)
+{
+  GumAddressIndexSlot * slots = self->slots;
+  guint mask = self->capacity - 1;
+  guint next;
+
+  for (next = (i + 1) & mask;
+      slots[next].address != NULL &&
+      gum_address_index_home (self, slots[next].address) != next;
+      next = (next + 1) & mask)
+  {
+    slots[i] = slots[next];
+    i = next;
+  }
+
+  slots[i].address = NULL;
+  slots[i].value = NULL;
+
+  self->size--;
+}
+
+static gint
+gum_address_index_find (GumAddressIndex * self,
+                        gpointer address)
+{
+  guint mask, i, distance;
+
+  if (self->size == 0)
+    return -1;
+
+  mask = self->capacity - 1;
+
+  for (i = gum_address_index_home (self, address), distance = 0;
+      self->slots[i].address != NULL;
+      i = (i + 1) & mask, distance++)
+  {
+    gpointer candidate = self->slots[i].address;
+
+    if (candidate == address)
+      return i;
+
+    if (((i - gum_address_index_home (self, candidate)) & mask) < distance)
+      break;
+  }
+
+  return -1;
+}
+
+static void
+gum_address_index_place (GumAddressIndex * self,
+                         gpointer address,
+                         gpointer value)
+{
+  guint mask = self->capacity - 1;
+  guint i, distance;
+
+  for (i = gum_address_index_home (self, address), distance = 0;
+      ;
+      i = (i + 1) & mask, distance++)
+  {
+    GumAddressIndexSlot * slot = &self->slots[i];
+    guint slot_distance;
+
+    if (slot->address == NULL)
+    {
+      slot->address = address;
+      slot->value = value;
+      return;
+    }
+
+    slot_distance = (i - gum_address_index_home (self, slot->address)) & mask;
+    if (slot_distance < distance)
+    {
+      GumAddressIndexSlot displaced = *slot;
+
+      slot->address = address;
+      slot->value = value;
+
+      address = displaced.address;
+      value = displaced.value;
+      distance = slot_distance;
+    }
+  }
+}
+
+static guint
+gum_address_index_home (GumAddressIndex * self,
+                        gpointer address)
+{
+  guint64 hash;
+
+  hash = (guint64) GPOINTER_TO_SIZE (address) *
+      G_GUINT64_CONSTANT (0x9e3779b97f4a7c15);
+
+  return (guint) (hash >> 32) & (self->capacity - 1);
+}
+
 static gpointer
 gum_page_address_from_pointer (gpointer ptr)
 {
@@ -2045,9 +3518,33 @@ gum_page_address_from_pointer (gpointer ptr)
       GPOINTER_TO_SIZE (ptr) & ~((gsize) gum_query_page_size () - 1));
 }
 
-static gint
-gum_page_address_compare (gconstpointer a,
-                          gconstpointer b)
+static GArray *
+gum_page_ranges_from_pages (GumPendingPage * pages,
+                            guint n_pages,
+                            gsize page_size)
 {
-  return GPOINTER_TO_SIZE (a) - GPOINTER_TO_SIZE (b);
+  GArray * ranges;
+  GumPageRange * range = NULL;
+  guint i;
+
+  ranges = g_array_new (FALSE, FALSE, sizeof (GumPageRange));
+
+  for (i = 0; i != n_pages; i++)
+  {
+    guint8 * page = pages[i].page;
+
+    if (range != NULL && range->start + range->size == page)
+    {
+      range->size += page_size;
+    }
+    else
+    {
+      GumPageRange r = { page, page_size };
+
+      g_array_append_val (ranges, r);
+      range = &g_array_index (ranges, GumPageRange, ranges->len - 1);
+    }
+  }
+
+  return ranges;
 }
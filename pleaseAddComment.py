@@ -4,151 +4,2511 @@ import re
 import argparse
 import time
 import textwrap
-
-# import pyparsing module for parsing C code
-from pyparsing import *
+import threading
+import hashlib
+import json
+import sqlite3
+import subprocess
+import os
+import glob
+import fnmatch
+import functools
+import random
+import mmap
+import struct
+from collections import deque
+from concurrent.futures import Future, ProcessPoolExecutor, ThreadPoolExecutor, as_completed
 
 # import openai module for using the OpenAI API
 import openai
 
+# import tiktoken module for counting tokens with the tokenizer of the model
+try:
+    import tiktoken
+except ImportError:
+    tiktoken = None
+
 # set OpenAI API key
 openai.api_key = ""
 openai_free_version = False
-max_try = 3
+max_try = 6
+
+# bounds of the exponential backoff between two attempts, in seconds
+backoff_base = 1.0
+backoff_max = 60.0
+
+# requests and tokens per minute allowed by the free OpenAI API version
+free_requests_per_minute = 4
+free_tokens_per_minute = 40000
+
+# parameters sent with every completion request, they are also part of the cache key
+model_parameters = {
+    "model": "text-davinci-003",
+    "temperature": 0.6,
+    "top_p": 1,
+    "frequency_penalty": 1,
+    "presence_penalty": 1,
+}
+
+# context window of the models, shared by the prompt and the completion
+model_context_tokens = {
+    "text-davinci-003": 4097,
+}
+
+# maximum number of tokens generated for the comment of one function
+max_comment_tokens = 512
+
+# prompts leaving less room than this for the completion are not sent
+min_comment_tokens = 64
+
+# instruction sent in front of every function
+function_prompt = "Could you write a top comment to explain important function steps and it goal.\n"
+
+# instruction sent in front of a batch of functions, the answer is split back to each function
+batch_prompt = ("Could you write a top comment to explain important steps and goal of each of the following functions.\n"
+                "Answer only with a JSON object mapping each function number to its comment.\n")
+
+# instructions sent in front of a type (struct, union, enum or typedef), alone or in a batch
+type_prompt = "Could you write a top comment to explain the purpose of the following C type and of its fields.\n"
+type_batch_prompt = ("Could you write a top comment to explain the purpose of each of the following C types and of their fields.\n"
+                     "Answer only with a JSON object mapping each type number to its comment.\n")
+
+# maximum number of functions sent in a single batch
+max_batch_functions = 8
+
+# introduces the summaries of the functions called by the function to comment, sent instead of their bodies
+callee_prompt = "The functions it calls are already commented, here is what they do:\n"
+
+# definitions this similar (estimated Jaccard similarity of their shingles) share the comment of the first one
+near_duplicate_threshold = 0.9
+
+# MinHash signatures of the definitions: number of bands and rows of the LSH index, and tokens per shingle
+minhash_bands = 4
+minhash_rows = 4
+shingle_tokens = 5
+
+# maximum number of callee summaries sent with a function, and of words per summary
+max_callees = 16
+max_callee_summary_words = 30
+
+# instruction sent in front of each part of a definition too large to be sent at once
+chunk_prompt = "Could you summarize in a few sentences what the following part of a C function does.\n"
+
+# instruction sent in front of the summaries of the parts of a large definition
+merge_prompt = ("Could you write a top comment to explain important function steps and it goal, "
+                "given the summaries of its parts.\n")
+
+# maximum number of tokens generated for the summary of one part of a large definition
+max_summary_tokens = 256
+
+# stream the completions, so the progress can be journaled and the latency measured
+stream_completions = True
+
+# seconds to wait for the first token, and for the whole completion, before cancelling a request
+first_token_timeout = 20
+request_timeout = 60
+
+# shared rate limiter used by every worker, set in main
+rate_limiter = None
+
+# shared cache of generated comments, set in main
+comment_cache = None
+
+# tokenizer of the model, loaded on first use
+_encoding = None
+
+
+class TokenBucket:
+    """
+    Thread-safe token bucket, refilled continuously up to one minute worth of tokens
+    """
+
+    def __init__(self, per_minute):
+        """
+        :param per_minute: Number of tokens added to the bucket every minute
+        """
+        self.capacity = float(per_minute)
+        self.tokens = float(per_minute)
+        self.rate = per_minute / 60.0
+        self.updated = time.monotonic()
+        self.lock = threading.Lock()
+
+    def _refill(self):
+        now = time.monotonic()
+        self.tokens = min(self.capacity, self.tokens + (now - self.updated) * self.rate)
+        self.updated = now
+
+    def wait_time(self, amount):
+        """
+        Compute how long to wait until the bucket holds the given amount of tokens
+        :param amount: The amount of tokens needed
+        :return: The number of seconds to wait, 0 if the tokens are available
+        """
+        with self.lock:
+            self._refill()
+            # a request larger than the bucket could never be served, so only wait for a full bucket
+            amount = min(amount, self.capacity)
+            return max(0.0, (amount - self.tokens) / self.rate)
+
+    def take(self, amount):
+        with self.lock:
+            self._refill()
+            self.tokens -= min(amount, self.capacity)
+
+
+class RateLimiter:
+    """
+    Limit the requests per minute and tokens per minute sent to the API, shared by all workers
+    """
+
+    def __init__(self, requests_per_minute=0, tokens_per_minute=0):
+        """
+        :param requests_per_minute: The maximum number of requests per minute, 0 for no limit
+        :param tokens_per_minute: The maximum number of tokens per minute, 0 for no limit
+        """
+        self.requests = TokenBucket(requests_per_minute) if requests_per_minute > 0 else None
+        self.tokens = TokenBucket(tokens_per_minute) if tokens_per_minute > 0 else None
+        self.lock = threading.Lock()
+
+    def acquire(self, tokens):
+        """
+        Block until a request using the given amount of tokens can be sent
+        :param tokens: The amount of tokens the request will use
+        """
+        # serialize the waiters so that the buckets are taken in arrival order
+        with self.lock:
+            while True:
+                wait = 0.0
+                if self.requests is not None:
+                    wait = max(wait, self.requests.wait_time(1))
+                if self.tokens is not None:
+                    wait = max(wait, self.tokens.wait_time(tokens))
+                if wait <= 0:
+                    break
+                time.sleep(wait)
+
+            if self.requests is not None:
+                self.requests.take(1)
+            if self.tokens is not None:
+                self.tokens.take(tokens)
+
+
+class CommentCache:
+    """
+    Persistent cache of generated comments, stored in a SQLite file and keyed by a hash of
+    the normalized definition, the prompt and the model parameters
+    """
+
+    def __init__(self, path):
+        """
+        :param path: Path to the SQLite file, created if it does not exist
+        """
+        self.connection = sqlite3.connect(path, check_same_thread=False)
+        self.connection.execute("CREATE TABLE IF NOT EXISTS comments (key TEXT PRIMARY KEY, comment TEXT NOT NULL)")
+        self.connection.commit()
+        self.lock = threading.Lock()
+        self.hits = 0
+        self.misses = 0
+
+    @staticmethod
+    def key(content, prompt):
+        """
+        Compute the cache key of a definition
+        :param content: The C definition
+        :param prompt: The instruction sent in front of the definition
+        :return: The hexadecimal SHA-256 of the normalized definition, prompt and model parameters
+        """
+        # whitespace changes should not invalidate the comment
+        normalized = " ".join(content.split())
+        digest = hashlib.sha256()
+        for part in (normalized, prompt, json.dumps(model_parameters, sort_keys=True)):
+            digest.update(part.encode('utf-8'))
+            digest.update(b'\0')
+        return digest.hexdigest()
+
+    def get(self, *keys):
+        """
+        Look up a comment
+        :param keys: The candidate keys, tried in order
+        :return: The comment of the first key found, or None
+        """
+        with self.lock:
+            for key in keys:
+                row = self.connection.execute("SELECT comment FROM comments WHERE key = ?", (key,)).fetchone()
+                if row is not None:
+                    self.hits += 1
+                    return row[0]
+            self.misses += 1
+            return None
+
+    def put(self, key, comment):
+        with self.lock:
+            self.connection.execute("INSERT OR REPLACE INTO comments (key, comment) VALUES (?, ?)", (key, comment))
+            self.connection.commit()
+
+    def close(self):
+        with self.lock:
+            self.connection.close()
+
+
+def get_encoding():
+    """
+    Load the tokenizer of the model
+    :return: The tiktoken encoding, or None if tiktoken is not installed
+    """
+    global _encoding
+    if _encoding is None and tiktoken is not None:
+        try:
+            _encoding = tiktoken.encoding_for_model(model_parameters["model"])
+        except KeyError:
+            # tiktoken does not know the tokenizer of local models, characters are counted instead
+            _encoding = False
+    return _encoding or None
+
+
+def count_tokens(text):
+    """
+    Count the tokens of a text with the tokenizer of the model
+    :param text: The text to count
+    :return: The number of tokens, or the number of characters as an upper bound if tiktoken is not installed
+    """
+    encoding = get_encoding()
+    if encoding is None:
+        return len(text)
+    return len(encoding.encode(text, disallowed_special=()))
+
+
+def completion_budget(prompt_tokens, wanted):
+    """
+    Compute the number of tokens the model may generate after a prompt
+    :param prompt_tokens: The number of tokens of the prompt
+    :param wanted: The number of tokens the completion should not exceed
+    :return: The completion budget, limited by what is left of the context window
+    """
+    context = model_context_tokens.get(model_parameters["model"], 4097)
+    return max(0, min(wanted, context - prompt_tokens))
+
+
+class TokenUsage:
+    """
+    Thread-safe accounting of the tokens spent per definition and for the whole file
+    """
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.prompt = 0
+        self.completion = 0
+        # keyed by a digest of the definition, so that the accounting does not keep the text of every definition alive
+        self.per_definition = {}
+
+    @staticmethod
+    def _key(content):
+        return hashlib.sha1(content.encode('utf-8')).digest()
+
+    def record(self, content, prompt_tokens, completion_tokens):
+        """
+        Account the tokens spent to comment a definition
+        :param content: The C definition
+        :param prompt_tokens: The prompt tokens attributed to the definition
+        :param completion_tokens: The completion tokens attributed to the definition
+        """
+        with self.lock:
+            self.prompt += prompt_tokens
+            self.completion += completion_tokens
+            key = self._key(content)
+            spent = self.per_definition.get(key, (0, 0))
+            self.per_definition[key] = (spent[0] + prompt_tokens, spent[1] + completion_tokens)
+
+    def spent(self, content):
+        """
+        :param content: The C definition
+        :return: A tuple containing the prompt and completion tokens spent on the definition, or None if nothing was spent
+        """
+        with self.lock:
+            return self.per_definition.get(self._key(content))
+
+
+# tokens spent by the current run
+token_usage = TokenUsage()
+
+
+class Histogram:
+    """
+    Histogram of a measure with fixed bucket boundaries, keeping the samples for the percentiles
+    """
+
+    def __init__(self, boundaries):
+        """
+        :param boundaries: The upper bounds of the buckets, in increasing order
+        """
+        self.boundaries = boundaries
+        self.samples = []
+
+    def add(self, value):
+        self.samples.append(value)
+
+    def percentile(self, fraction):
+        ordered = sorted(self.samples)
+        return ordered[min(len(ordered) - 1, int(fraction * len(ordered)))]
+
+    def to_dict(self):
+        """
+        :return: The buckets, the count, the mean and the usual percentiles, ready to be serialized to JSON
+        """
+        buckets = [{"le": boundary, "count": sum(1 for sample in self.samples if sample <= boundary)}
+                   for boundary in self.boundaries]
+        buckets.append({"le": "+Inf", "count": len(self.samples)})
+        report = {"count": len(self.samples), "buckets": buckets}
+        if self.samples:
+            report["mean"] = sum(self.samples) / len(self.samples)
+            for name, fraction in (("p50", 0.5), ("p90", 0.9), ("p99", 0.99)):
+                report[name] = self.percentile(fraction)
+        return report
+
+
+class RequestMetrics:
+    """
+    Thread-safe latency and throughput measures of the requests sent to the model
+    """
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        seconds = [0.1, 0.25, 0.5, 1, 2.5, 5, 10, 25, 60]
+        self.time_to_first_token = Histogram(seconds)
+        self.total_time = Histogram(seconds)
+        self.tokens_per_second = Histogram([1, 2, 5, 10, 20, 50, 100, 200, 500])
+        self.timeouts = 0
+
+    def record(self, time_to_first_token, total_time, completion_tokens):
+        """
+        Record a completed request
+        :param time_to_first_token: Seconds between sending the request and receiving the first token
+        :param total_time: Seconds between sending the request and receiving the last token
+        :param completion_tokens: The number of tokens generated
+        """
+        with self.lock:
+            self.time_to_first_token.add(time_to_first_token)
+            self.total_time.add(total_time)
+            if total_time > 0:
+                self.tokens_per_second.add(completion_tokens / total_time)
+
+    def record_timeout(self):
+        with self.lock:
+            self.timeouts += 1
+
+    def to_dict(self):
+        with self.lock:
+            return {
+                "timeouts": self.timeouts,
+                "time_to_first_token": self.time_to_first_token.to_dict(),
+                "total_time": self.total_time.to_dict(),
+                "tokens_per_second": self.tokens_per_second.to_dict(),
+            }
+
+
+# latency of the requests of the current run
+request_metrics = RequestMetrics()
+
+
+class RequestTimeout(Exception):
+    """
+    Raised when a streamed completion takes longer than request_timeout
+    """
+
+
+class CircuitBreaker:
+    """
+    Shared by all workers: pauses them all when the API asks to slow down, and stops them all when
+    retrying can't help, e.g. when the quota is exhausted
+    """
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.resume_at = 0.0
+        self.reason = None
+
+    def pause(self, seconds):
+        """
+        Hold every request for the given number of seconds
+        """
+        with self.lock:
+            self.resume_at = max(self.resume_at, time.monotonic() + seconds)
+
+    def trip(self, reason):
+        """
+        Stop every request for the rest of the run
+        :param reason: Why the requests are stopped, reported in the run summary
+        """
+        with self.lock:
+            if self.reason is None:
+                self.reason = reason
+
+    def wait(self):
+        """
+        Block while the requests are paused
+        :return: False if the requests are stopped
+        """
+        while True:
+            with self.lock:
+                if self.reason is not None:
+                    return False
+                delay = self.resume_at - time.monotonic()
+            if delay <= 0:
+                return True
+            time.sleep(delay)
+
+
+# stops or pauses the requests of every worker, see classify_error
+circuit_breaker = CircuitBreaker()
+
+# kinds of errors returned by classify_error
+ERROR_TRANSIENT = "transient"
+ERROR_TIMEOUT = "timeout"
+ERROR_RATE_LIMITED = "rate limited"
+ERROR_FATAL = "fatal"
+ERROR_INVALID = "invalid"
+
+# durations used by the rate limit headers, e.g. 20ms, 1.5s or 6m0s
+_DURATION_RE = re.compile(r'(\d+(?:\.\d+)?)(ms|s|m|h)')
+_DURATION_UNITS = {"ms": 0.001, "s": 1, "m": 60, "h": 3600}
+
+
+def retry_after(error):
+    """
+    Read how long the server asks to wait before retrying
+    :param error: The error raised by the openai module
+    :return: The number of seconds to wait, or None if the server gave no hint
+    """
+    headers = getattr(error, "headers", None) or {}
+    headers = {str(name).lower(): str(value) for name, value in headers.items()}
+    if "retry-after-ms" in headers:
+        with contextlib.suppress(ValueError):
+            return float(headers["retry-after-ms"]) / 1000
+    if "retry-after" in headers:
+        with contextlib.suppress(ValueError):
+            return float(headers["retry-after"])
+    # otherwise wait for the limit that is reset last
+    resets = [sum(float(amount) * _DURATION_UNITS[unit] for amount, unit in _DURATION_RE.findall(headers[name]))
+              for name in ("x-ratelimit-reset-requests", "x-ratelimit-reset-tokens") if name in headers]
+    return max(resets) if resets else None
+
+
+def classify_error(error):
+    """
+    Decide what to do with an error raised while querying the model
+    :param error: The exception
+    :return: One of the ERROR_* kinds, or None if the error does not come from the API
+    """
+    if isinstance(error, (RequestTimeout, openai.error.Timeout)):
+        return ERROR_TIMEOUT
+    if isinstance(error, openai.error.RateLimitError):
+        # an exhausted quota won't come back by waiting
+        if getattr(error, "code", None) == "insufficient_quota":
+            return ERROR_FATAL
+        return ERROR_RATE_LIMITED
+    if isinstance(error, (openai.error.AuthenticationError, openai.error.PermissionError)):
+        return ERROR_FATAL
+    if isinstance(error, openai.error.InvalidRequestError):
+        return ERROR_INVALID
+    if isinstance(error, (openai.error.APIConnectionError, openai.error.ServiceUnavailableError,
+                          openai.error.TryAgain)):
+        return ERROR_TRANSIENT
+    if isinstance(error, openai.error.OpenAIError):
+        # server errors are worth retrying, the other ones will fail again
+        status = getattr(error, "http_status", None)
+        return ERROR_TRANSIENT if status is None or status >= 500 else ERROR_INVALID
+    return None
+
+
+def backoff_delay(attempt, hint=None):
+    """
+    Compute the delay before the next attempt, with full jitter
+    :param attempt: The number of attempts already made, minus one
+    :param hint: The delay asked by the server, if any, used as a lower bound
+    :return: The number of seconds to wait
+    """
+    delay = random.uniform(0, min(backoff_max, backoff_base * 2 ** attempt))
+    return delay if hint is None else max(hint, delay)
+
+
+def format_comment(text):
+    """
+    Turn the text generated by the model into a C comment
+    :param text: The generated text
+    :return: The comment, wrapped at 80 columns
+    """
+    return "\n//".join(textwrap.wrap(text, 80, replace_whitespace=False)) + "\n"
+
+
+class OpenAIBackend:
+    """
+    Completions served by the OpenAI API, one prompt per request
+    """
+
+    def _stream(self, query, max_tokens, on_text):
+        """
+        Stream a completion, cancelling it if it takes too long
+        :param query: The prompt
+        :param max_tokens: The maximum number of tokens to generate
+        :param on_text: Called with the text generated so far each time tokens arrive, may be None
+        :return: A tuple containing the generated text and the number of seconds before the first token
+        """
+        started = time.monotonic()
+        first_token = None
+        parts = []
+        # the HTTP read timeout cancels the request if the first token, or any later one, does not come in time
+        response = openai.Completion.create(
+            prompt=query,
+            max_tokens=max_tokens,
+            stream=True,
+            request_timeout=first_token_timeout,
+            **model_parameters
+        )
+        try:
+            for chunk in response:
+                now = time.monotonic()
+                if first_token is None:
+                    first_token = now - started
+                if now - started > request_timeout:
+                    raise RequestTimeout(f"no complete answer after {request_timeout} seconds")
+                parts.append(chunk.choices[0].text)
+                if on_text is not None:
+                    on_text("".join(parts))
+        finally:
+            close = getattr(response, "close", None)
+            if close is not None:
+                close()
+        return "".join(parts), first_token if first_token is not None else time.monotonic() - started
+
+    def complete(self, query, max_tokens, on_text=None):
+        """
+        Generate the completion of a prompt
+        :param query: The prompt
+        :param max_tokens: The maximum number of tokens to generate
+        :param on_text: Called with the text generated so far if the completion is streamed, may be None
+        :return: A tuple containing the generated text, the number of seconds before the first token and the usage
+                 reported by the server (a dictionary with the prompt and completion tokens) or None
+        """
+        if stream_completions:
+            text, time_to_first_token = self._stream(query, max_tokens, on_text)
+            # the usage is not reported for streamed completions
+            return text, time_to_first_token, None
 
-def _query_model(query, max_tokens=4096):
+        started = time.monotonic()
+        response = openai.Completion.create(
+            prompt=query,
+            max_tokens=max_tokens,
+            request_timeout=request_timeout,
+            **model_parameters
+        )
+        return response.choices[0].text, time.monotonic() - started, getattr(response, "usage", None)
+
+
+class LocalBackend:
+    """
+    Completions served by a self-hosted OpenAI compatible server (vLLM, llama.cpp, TGI...). The prompts of the
+    workers are batched dynamically into a single request, which the server runs as one forward pass.
+    Every prompt starts with one of the fixed instructions, and a batch only holds prompts starting with the
+    same one, so a server caching prefixes computes it once.
+    """
+
+    def __init__(self, api_base, model, max_batch=32, batch_window=0.02, max_inflight=2, api_key="local"):
+        """
+        :param api_base: The URL of the server, e.g. http://localhost:8000/v1
+        :param model: The name of the model served
+        :param max_batch: The maximum number of prompts sent in a single request
+        :param batch_window: Seconds to wait for more prompts before sending a batch that is not full
+        :param max_inflight: The maximum number of batches sent at the same time
+        :param api_key: The key expected by the server, if any
+        """
+        self.api_base = api_base
+        self.api_key = api_key
+        self.model = model
+        self.max_batch = max_batch
+        self.batch_window = batch_window
+        self.condition = threading.Condition()
+        # prompts waiting for a batch, each one a tuple of its batch key, prompt, and future
+        self.pending = []
+        self.sender = ThreadPoolExecutor(max_workers=max(1, max_inflight))
+        self.batches = 0
+        threading.Thread(target=self._dispatch, daemon=True).start()
+
+    @staticmethod
+    def _prefix(query):
+        # the fixed instruction a prompt starts with
+        for prompt in (function_prompt, batch_prompt, chunk_prompt, merge_prompt, type_prompt, type_batch_prompt):
+            if query.startswith(prompt):
+                return prompt
+        return ""
+
+    def complete(self, query, max_tokens, on_text=None):
+        """
+        Generate the completion of a prompt, in a batch with the prompts of the other workers.
+        The completions are not streamed, so on_text is not used.
+        :param query: The prompt
+        :param max_tokens: The maximum number of tokens to generate
+        :return: A tuple containing the generated text, the number of seconds until it was received and the usage
+                 of the prompt, its share of the tokens of the batch
+        """
+        started = time.monotonic()
+        future = Future()
+        with self.condition:
+            # a request holds a single completion budget, so it only batches prompts with the same one
+            self.pending.append(((self._prefix(query), max_tokens), query, future))
+            self.condition.notify()
+        text, usage = future.result()
+        return text, time.monotonic() - started, usage
+
+    def _dispatch(self):
+        while True:
+            with self.condition:
+                while not self.pending:
+                    self.condition.wait()
+                # give the other workers a chance to join the batch
+                deadline = time.monotonic() + self.batch_window
+                while len(self.pending) < self.max_batch and time.monotonic() < deadline:
+                    self.condition.wait(deadline - time.monotonic())
+                key = self.pending[0][0]
+                batch, rest = [], []
+                for item in self.pending:
+                    (batch if item[0] == key and len(batch) < self.max_batch else rest).append(item)
+                self.pending = rest
+            self.batches += 1
+            self.sender.submit(self._send, key[1], [(query, future) for _, query, future in batch])
+
+    def _send(self, max_tokens, batch):
+        try:
+            parameters = dict(model_parameters, model=self.model)
+            response = openai.Completion.create(
+                prompt=[query for query, _ in batch],
+                max_tokens=max_tokens,
+                request_timeout=request_timeout,
+                api_base=self.api_base,
+                api_key=self.api_key,
+                **parameters
+            )
+            texts = [None] * len(batch)
+            for choice in response.choices:
+                texts[choice.index] = choice.text
+            if any(text is None for text in texts):
+                raise openai.error.APIError(f"the server answered {len(response.choices)} of {len(batch)} prompts")
+
+            # the server reports the usage of the whole batch, it is shared in proportion to each prompt and completion
+            usage = getattr(response, "usage", None)
+            shares = [None] * len(batch)
+            if usage is not None:
+                prompt_sizes = [count_tokens(query) for query, _ in batch]
+                completion_sizes = [count_tokens(text) for text in texts]
+                shares = [{"prompt_tokens": usage["prompt_tokens"] * prompt_size // max(1, sum(prompt_sizes)),
+                           "completion_tokens": usage["completion_tokens"] * completion_size // max(1, sum(completion_sizes))}
+                          for prompt_size, completion_size in zip(prompt_sizes, completion_sizes)]
+        except Exception as e:
+            # every worker of the batch handles the error, and retries on its own
+            for _, future in batch:
+                future.set_exception(e)
+            return
+        for (_, future), text, share in zip(batch, texts, shares):
+            future.set_result((text, share))
+
+
+# backend serving the completions, the OpenAI API unless a local server is configured in main
+backend = OpenAIBackend()
+
+
+def _query_model(query, max_tokens=max_comment_tokens, on_text=None):
     """
     Function which sends a query to davinci-003 and calls a callback when the response is available.
     Blocks until the response is received
     :param query: The request to send to davinci-003
-    :param cb: Tu function to which the response will be passed to.
+    :param max_tokens: The maximum number of tokens to generate
+    :param on_text: Called with the text generated so far while the completion is streamed, may be None
+    :return: A tuple containing the generated text, the prompt tokens and the completion tokens, or None if the request failed
     """
-    # subtract the length of the query from the maximum number of tokens
-    max_tokens = max_tokens - len(query)
+    # the prompt and the completion share the context window of the model
+    prompt_tokens = count_tokens(query)
+    max_tokens = completion_budget(prompt_tokens, max_tokens)
+    if max_tokens < min_comment_tokens:
+        print(f"Skipping a prompt of {prompt_tokens} tokens, it leaves no room for the comment")
+        return None
+
+    # the API accounts the prompt and the completion budget against the tokens per minute
+    tokens = prompt_tokens + max_tokens
     
-    # max_try_counter
-    max_try_counter = 0
+    attempt = 0
     
-    while max_try_counter < max_try:
+    while True:
+
+        # every worker stops together when the API can't serve us
+        if not circuit_breaker.wait():
+            return None
     
+        # wait for the rate limiter before sending the query
+        if rate_limiter is not None:
+            rate_limiter.acquire(tokens)
+
         # try to send the query to the model
+        started = time.monotonic()
         try:
-            response = openai.Completion.create(
-                model="text-davinci-003",
-                prompt=query,
-                temperature=0.6,
-                max_tokens=max_tokens,
-                top_p=1,
-                frequency_penalty=1,
-                presence_penalty=1,
-                timeout=60  #
-            )
-            response = "\n//".join(textwrap.wrap(response.choices[0].text, 80, replace_whitespace=False)) + "\n"
-            return response
-        except openai.InvalidRequestError as e:
-            print(f"Invalid request: {str(e)}")
-            max_try_counter += 1
-            print("API limit reached, waiting 60 seconds. Don't hesitate to register a paid account \
-                  to avoid this limit.")
-            time.sleep(60)
-            
+            text, time_to_first_token, usage = backend.complete(query, max_tokens, on_text)
+
+            # prefer the usage reported by the API over our own count
+            if usage is not None:
+                result = text, usage["prompt_tokens"], usage["completion_tokens"]
+            else:
+                result = text, prompt_tokens, count_tokens(text)
+            request_metrics.record(time_to_first_token, time.monotonic() - started, result[2])
+            return result
+        except Exception as e:
+            kind = classify_error(e)
+            if kind is None:
+                raise
+            if kind == ERROR_TIMEOUT:
+                request_metrics.record_timeout()
+            if kind == ERROR_FATAL:
+                print(f"Stopping all requests: {str(e)}")
+                circuit_breaker.trip(str(e))
+                return None
+            attempt += 1
+            if kind == ERROR_INVALID or attempt >= max_try:
+                print(f"Request failed ({kind}): {str(e)}")
+                return None
+
+            delay = backoff_delay(attempt - 1, retry_after(e))
+            print(f"Request failed ({kind}), retrying in {delay:.1f} seconds: {str(e)}")
+            if kind == ERROR_RATE_LIMITED:
+                # the limit is shared, so every worker backs off
+                circuit_breaker.pause(delay)
+            else:
+                time.sleep(delay)
+
+
+# comments of a definition, ignored when looking for its name
+_COMMENT_TEXT_RE = re.compile(r'/\*.*?\*/|//[^\n]*', re.DOTALL)
+
+# definitions of types start with typedef, or with struct, union or enum followed by the tag and attributes, if any,
+# and the brace. Functions returning a struct have their name and parameters before the brace.
+_TYPE_DEFINITION_RE = re.compile(r"""
+    (?:\s+|/\*.*?\*/|//[^\n]*)*
+    (?:typedef\b
+      |(?:struct|union|enum)\b(?:\s*(?:[A-Za-z_]\w*\b|__attribute__\s*\(\((?:[^()]|\([^()]*\))*\)\)))*\s*\{)""",
+    re.DOTALL | re.VERBOSE)
+
+
+def is_type_definition(content):
+    """
+    Tell the definitions of types from the ones of functions
+    :param content: The C definition
+    :return: True if it defines a struct, union, enum or typedef
+    """
+    return _TYPE_DEFINITION_RE.match(content) is not None
+
+
+def cached_comment(content):
+    """
+    Look up the comment of a C definition in the cache, whether it was generated alone, in a batch or in parts
+    :param content: The C definition
+    :return: The comment, or None if it is not cached
+    """
+    if comment_cache is None:
+        return None
+    prompts = (type_prompt, type_batch_prompt) if is_type_definition(content) else (function_prompt, batch_prompt, merge_prompt)
+    return comment_cache.get(*(CommentCache.key(content, prompt) for prompt in prompts))
+
+
+def request_comment(content, on_text=None, callees=None):
+    """
+    Send a single C definition to the model
+    :param content: The C definition to comment
+    :param on_text: Called with the text generated so far while the completion is streamed, may be None
+    :param callees: A list of tuples, each containing the name and the summary of a function it calls, may be None
+    :return: The comment, or None if the request failed
+    """
+    prompt = type_prompt if is_type_definition(content) else function_prompt
+    # the comment does not depend much on the summaries, so they are not part of the cache key
+    context = "" if not callees else callee_prompt + "".join(f"{name}: {summary}\n" for name, summary in callees) + "\n"
+    response = _query_model(prompt + context + str(content), on_text=on_text)
+    if response is None:
+        return None
+
+    text, prompt_tokens, completion_tokens = response
+    token_usage.record(content, prompt_tokens, completion_tokens)
+
+    description = format_comment(text)
+    if comment_cache is not None:
+        comment_cache.put(CommentCache.key(content, prompt), description)
+    return description
+
+
+def parse_batch_response(response, count):
+    """
+    Split the structured answer to a batch request
+    :param response: The text generated by the model
+    :param count: The number of functions in the batch
+    :return: The list of generated texts, in the order of the functions, or None if the answer is malformed
+    """
+    # the model sometimes surrounds the JSON object with some text
+    start = response.find('{')
+    end = response.rfind('}')
+    if start < 0 or end < start:
+        return None
+    try:
+        answer = json.loads(response[start:end + 1])
+    except ValueError:
+        return None
+
+    if not isinstance(answer, dict):
+        return None
+    texts = [answer.get(str(i + 1)) for i in range(count)]
+    if not all(isinstance(text, str) and text.strip() for text in texts):
+        return None
+    return texts
+
+
+def request_batch_comments(contents):
+    """
+    Send several C definitions to the model in a single request
+    :param contents: The C definitions to comment, either all functions or all types
+    :return: The list of comments, in the same order as the definitions, or None if the answer can't be split
+    """
+    if is_type_definition(contents[0]):
+        prompt, label = type_batch_prompt, "Type"
+    else:
+        prompt, label = batch_prompt, "Function"
+    query = prompt + "".join(f"{label} {i + 1}:\n{content}\n\n" for i, content in enumerate(contents))
+    response = _query_model(query, max_comment_tokens * len(contents))
+    if response is None:
+        return None
+
+    text, prompt_tokens, completion_tokens = response
+    texts = parse_batch_response(text, len(contents))
+    if texts is None:
+        # the tokens are spent anyway, account them to the first definition
+        token_usage.record(contents[0], prompt_tokens, completion_tokens)
+        return None
+
+    # share the tokens of the request in proportion to each definition and each comment
+    definition_tokens = [count_tokens(content) for content in contents]
+    comment_tokens = [count_tokens(text) for text in texts]
+    for content, own_prompt, own_completion in zip(contents, definition_tokens, comment_tokens):
+        token_usage.record(content,
+                           prompt_tokens * own_prompt // max(1, sum(definition_tokens)),
+                           completion_tokens * own_completion // max(1, sum(comment_tokens)))
+
+    # lay the comments out like the ones the model writes for a single function
+    descriptions = [format_comment("\n\n// " + text.strip()) for text in texts]
+    if comment_cache is not None:
+        for content, description in zip(contents, descriptions):
+            comment_cache.put(CommentCache.key(content, prompt), description)
+    return descriptions
+
+
+def request_comments(contents, on_texts=None):
+    """
+    Comment a batch of C definitions, falling back to one request per definition if needed
+    :param contents: The C definitions to comment
+    :param on_texts: For each definition, called with the text streamed so far by its single request, may be None
+    :return: The list of comments, in the same order as the definitions
+    """
+    if len(contents) > 1:
+        descriptions = request_batch_comments(contents)
+        if descriptions is not None:
+            return descriptions
+        print(f"Could not split the answer for a batch of {len(contents)} functions, sending them one by one")
+    if on_texts is None:
+        on_texts = [None] * len(contents)
+    return [request_comment(content, on_text) for content, on_text in zip(contents, on_texts)]
+
+
+# statement boundaries: an opening brace, a closing brace or a semicolon ending a line
+_STATEMENT_RE = re.compile(r'([{};])([ \t]*\n)?')
+
+
+def split_definition(content, chunk_tokens):
+    """
+    Split a large C definition into parts at statement boundaries, preferring the shallowest ones
+    :param content: The C definition
+    :param chunk_tokens: The maximum number of tokens of a part
+    :return: The list of parts, which concatenated give back the definition
+    """
+    # collect the offsets following a statement boundary, with the brace depth there
+    boundaries = []
+    depth = 0
+    for match in _STATEMENT_RE.finditer(content):
+        if match.group(1) == '{':
+            depth += 1
+        elif match.group(1) == '}':
+            depth -= 1
+        if match.group(2) is not None:
+            boundaries.append((match.end(), depth))
+
+    # turn the token budget into characters once, counting tokens for every candidate would be too slow
+    window = max(1, chunk_tokens * len(content) // max(1, count_tokens(content)))
+
+    chunks = []
+    start = 0
+    while len(content) - start > window:
+        candidates = [(boundary_depth, -offset) for offset, boundary_depth in boundaries if start < offset <= start + window]
+        # cut at the latest of the shallowest boundaries, or in the middle of a statement if there is none
+        end = -min(candidates)[1] if candidates else start + window
+        chunks.append(content[start:end])
+        start = end
+    chunks.append(content[start:])
+    return chunks
+
+
+def definition_signature(content):
+    """
+    Extract the signature of a C definition
+    :param content: The C definition
+    :return: The text preceding the opening brace of the body
+    """
+    brace = content.find('{')
+    return content if brace < 0 else content[:brace].rstrip()
+
+
+def request_chunk_summary(signature, chunk, index, count):
+    """
+    Summarize one part of a large C definition
+    :param signature: The signature of the definition
+    :param chunk: The part to summarize
+    :param index: The index of the part
+    :param count: The number of parts of the definition
+    :return: A tuple containing the summary, the prompt tokens and the completion tokens, or None if the request failed
+    """
+    query = chunk_prompt + f"Signature:\n{signature}\n\nPart {index + 1} of {count}:\n{chunk}\n"
+    return _query_model(query, max_summary_tokens)
+
+
+def request_merged_comment(content, summaries):
+    """
+    Write the top comment of a large C definition from the summaries of its parts
+    :param content: The C definition
+    :param summaries: The results of request_chunk_summary for each part
+    :return: The comment, or None if no part could be summarized
+    """
+    for summary in summaries:
+        if summary is not None:
+            token_usage.record(content, summary[1], summary[2])
+    texts = [summary[0].strip() for summary in summaries if summary is not None]
+    if not texts:
+        return None
+
+    query = merge_prompt + definition_signature(content) + "\n\n" + "".join(
+        f"Part {i + 1}: {text}\n" for i, text in enumerate(texts))
+    response = _query_model(query)
+    if response is None:
+        return None
+
+    text, prompt_tokens, completion_tokens = response
+    token_usage.record(content, prompt_tokens, completion_tokens)
+
+    description = format_comment(text)
+    if comment_cache is not None:
+        comment_cache.put(CommentCache.key(content, merge_prompt), description)
+    return description
+
+
+def submit_chunked_comment(executor, content, chunk_tokens):
+    """
+    Comment a large C definition by summarizing its parts in parallel, then merging the summaries
+    :param executor: The pool of workers sending the requests
+    :param content: The C definition
+    :param chunk_tokens: The maximum number of tokens of a part
+    :return: A future resolving to a list holding the comment
+    """
+    signature = definition_signature(content)
+    chunks = split_definition(content, chunk_tokens)
+    result = Future()
+    chunk_futures = [executor.submit(request_chunk_summary, signature, chunk, i, len(chunks))
+                     for i, chunk in enumerate(chunks)]
+    remaining = [len(chunk_futures)]
+    lock = threading.Lock()
+
+    def on_merged(future):
+        try:
+            result.set_result([future.result()])
+        except Exception as e:
+            result.set_exception(e)
+
+    def on_chunk_done(_):
+        with lock:
+            remaining[0] -= 1
+            if remaining[0] != 0:
+                return
+        # the last summary is in, so the merge can be queued without blocking a worker
+        try:
+            summaries = [future.result() for future in chunk_futures]
+            executor.submit(request_merged_comment, content, summaries).add_done_callback(on_merged)
+        except Exception as e:
+            result.set_exception(e)
+
+    for future in chunk_futures:
+        future.add_done_callback(on_chunk_done)
+    return result
+
+
+def make_batches(definitions, indices, batch_tokens):
+    """
+    Pack consecutive small definitions of the same kind into batches
+    :param definitions: The C definitions
+    :param indices: The indices of the definitions to pack
+    :param batch_tokens: The maximum number of tokens of the definitions packed in a batch, 0 to disable batching
+    :return: A list of batches, each being a list of indices
+    """
+    batches = []
+    batch, batch_size, batch_types = [], 0, False
+    for i in indices:
+        definition = definitions[i]
+        size = count_tokens(definition)
+        types = is_type_definition(definition)
+        # a definition that does not fit starts a new batch, large ones end up alone. Types and functions are
+        # asked with different prompts, so they are not mixed.
+        if batch and (batch_size + size > batch_tokens or len(batch) >= max_batch_functions or types != batch_types):
+            batches.append(batch)
+            batch, batch_size = [], 0
+        batch.append(i)
+        batch_size += size
+        batch_types = types
+    if batch:
+        batches.append(batch)
+    return batches
+
+
+def _request_definitions(definitions, indices, on_texts):
+    # the text of the definitions is only materialized once a worker sends them
+    return request_comments([definitions[i] for i in indices], on_texts)
 
-def query_func_model(content):
-    query = "Could you write a top comment to explain important function steps and it goal.\n" + str(content)
-    return _query_model(query)
+
+# identifiers, the ones followed by a parenthesis in a signature are names of functions
+_IDENTIFIER_RE = re.compile(r'[A-Za-z_]\w*')
+_CALLED_RE = re.compile(r'([A-Za-z_]\w*)\s*\(')
+
+
+def definition_name(content):
+    """
+    Extract the name of a function definition
+    :param content: The C definition
+    :return: The name of the function, or None for a type definition
+    """
+    if is_type_definition(content):
+        return None
+    for name in _CALLED_RE.findall(definition_signature(content)):
+        if name not in ('__attribute__', '__declspec'):
+            return name
+    return None
+
+
+# name of a type: the typedef name, else the tag following the keyword
+_TYPEDEF_NAME_RE = re.compile(r'\(\s*\*\s*([A-Za-z_]\w*)\s*\)|([A-Za-z_]\w*)(?:\s*\[[^\]]*\])*\s*;\s*\Z')
+_TAG_RE = re.compile(r'\b(?:struct|union|enum)\s+(?!__attribute__)([A-Za-z_]\w*)')
+
+
+def symbol_name(content):
+    """
+    Extract the name under which a definition is looked up
+    :param content: The C definition
+    :return: The name of the function or type, or None if it has none
+    """
+    if not is_type_definition(content):
+        return definition_name(content)
+    content = _COMMENT_TEXT_RE.sub(' ', content)
+    if content.lstrip().startswith('typedef'):
+        match = _TYPEDEF_NAME_RE.search(content)
+        if match is not None:
+            return match.group(1) or match.group(2)
+    match = _TAG_RE.search(definition_signature(content))
+    return None if match is None else match.group(1)
+
+
+def call_graph(definitions, indices):
+    """
+    Find the functions of the file called, or referenced, by some of its functions
+    :param definitions: The C definitions of the file
+    :param indices: The indices of the functions whose callees are wanted
+    :return: A dictionary mapping each of these indices to the list of indices of its callees, at most max_callees
+    """
+    names = {}
+    for i, definition in enumerate(definitions):
+        name = definition_name(definition)
+        if name is not None:
+            names[name] = i
+
+    graph = {}
+    for i in indices:
+        definition = definitions[i]
+        body = definition[definition.find('{') + 1:]
+        callees = []
+        for name in dict.fromkeys(_IDENTIFIER_RE.findall(body)):
+            callee = names.get(name)
+            if callee is not None and callee != i and len(callees) < max_callees:
+                callees.append(callee)
+        graph[i] = callees
+    return graph
+
+
+def dependency_order(graph):
+    """
+    Order the functions so that every function comes after its callees, dropping the calls that close a cycle
+    :param graph: The call graph returned by call_graph, the callees missing from it are already available
+    :return: A tuple containing the indices sorted callees first, and the call graph without cycles
+    """
+    order = []
+    acyclic = {i: [] for i in graph}
+    # 0: not visited, 1: being visited, 2: done
+    state = dict.fromkeys(graph, 0)
+    for root in graph:
+        if state[root]:
+            continue
+        state[root] = 1
+        stack = [(root, iter(graph[root]))]
+        # iterative depth first search, the deepest functions of the file are the first ones done
+        while stack:
+            i, callees = stack[-1]
+            for callee in callees:
+                if callee not in graph or state[callee] == 2:
+                    acyclic[i].append(callee)
+                elif state[callee] == 0:
+                    acyclic[i].append(callee)
+                    state[callee] = 1
+                    stack.append((callee, iter(graph[callee])))
+                    break
+                # a callee being visited is a recursive call, waiting for it would never end
+            else:
+                state[i] = 2
+                order.append(i)
+                stack.pop()
+    return order, acyclic
+
+
+def comment_summary(description):
+    """
+    Shorten a comment to the one-line summary sent with its callers
+    :param description: The comment
+    :return: Its first sentence, at most max_callee_summary_words words long
+    """
+    words = " ".join(line.strip().lstrip('/') for line in description.splitlines()).split()
+    summary = []
+    for word in words[:max_callee_summary_words]:
+        summary.append(word)
+        if word.endswith('.'):
+            break
+    return " ".join(summary)
+
+
+def submit_with_callees(executor, content, callees, on_text=None):
+    """
+    Comment a function once the functions it calls are commented, sending their summaries along
+    :param executor: The pool of workers sending the requests
+    :param content: The C definition
+    :param callees: A list of tuples, each containing the name of a callee and its result from submit_all
+    :param on_text: Called with the text streamed so far by the request, may be None
+    :return: A future resolving to a list holding the comment
+    """
+    result = Future()
+    futures = list({id(callee[0]): callee[0] for _, callee in callees if isinstance(callee, tuple)}.values())
+    remaining = [len(futures)]
+    lock = threading.Lock()
+
+    def on_commented(future):
+        try:
+            result.set_result([future.result()])
+        except Exception as e:
+            result.set_exception(e)
+
+    def summaries():
+        for name, callee in callees:
+            if isinstance(callee, tuple):
+                # a callee whose request failed is just not summarized
+                if callee[0].exception() is not None:
+                    continue
+                callee = callee[0].result()[callee[1]]
+            if callee is not None:
+                yield name, comment_summary(callee)
+
+    def send():
+        # the callees are in, so the request can be queued without blocking a worker
+        try:
+            executor.submit(request_comment, content, on_text, list(summaries())).add_done_callback(on_commented)
+        except Exception as e:
+            result.set_exception(e)
+
+    def on_callee_done(_):
+        with lock:
+            remaining[0] -= 1
+            if remaining[0] != 0:
+                return
+        send()
+
+    if not futures:
+        send()
+    for future in futures:
+        future.add_done_callback(on_callee_done)
+    return result
+
+
+# tokens of a definition for the duplicate search: comments (dropped), literals, identifiers, numbers and punctuation
+_DUPLICATE_TOKEN_RE = re.compile(r"""/\*.*?\*/|//[^\n]*|"(?:\\.|[^"\\\n])*"|'(?:\\.|[^'\\\n])*'|[A-Za-z_]\w*|\d[\w.]*|\S""",
+                                 re.DOTALL)
+
+# words keeping their meaning whatever the code, the other identifiers are numbered when looking for duplicates
+_C_KEYWORDS = frozenset("""auto break case char const continue default do double else enum extern float for goto if
+    inline int long register restrict return short signed sizeof static struct switch typedef union unsigned void
+    volatile while""".split())
+
+# parameters of the hash functions of the MinHash signatures, modulo a Mersenne prime
+_MINHASH_PRIME = (1 << 61) - 1
+_MINHASH_SEEDS = [(random.Random(seed).randrange(1, _MINHASH_PRIME), random.Random(-seed).randrange(_MINHASH_PRIME))
+                  for seed in range(1, minhash_bands * minhash_rows + 1)]
+
+
+class Fingerprint:
+    """
+    Structure of a definition, the same for copies of a definition whose identifiers are renamed
+    """
+
+    __slots__ = ('digest', 'identifiers', 'signature', 'name')
+
+    def __init__(self, content):
+        """
+        :param content: The C definition
+        """
+        tokens = []
+        self.identifiers = []
+        numbers = {}
+        for token in _DUPLICATE_TOKEN_RE.findall(content):
+            if token.startswith(('/*', '//')):
+                continue
+            if (token[0].isalpha() or token[0] == '_') and token not in _C_KEYWORDS:
+                # identifiers are numbered in order of appearance
+                self.identifiers.append(token)
+                token = '$%d' % numbers.setdefault(token, len(numbers))
+            tokens.append(token)
+        # types and functions are asked with different prompts, they never share a comment
+        tokens.insert(0, 'type' if is_type_definition(content) else 'function')
+        self.digest = hashlib.sha256("\0".join(tokens).encode('utf-8')).digest()
+        self.name = symbol_name(content)
+
+        # MinHash of the shingles, the similarity of two definitions is the fraction of equal hashes
+        shingles = {int.from_bytes(hashlib.blake2b("\0".join(tokens[i:i + shingle_tokens]).encode('utf-8'),
+                                                   digest_size=8).digest(), 'little') & _MINHASH_PRIME
+                    for i in range(max(1, len(tokens) - shingle_tokens + 1))}
+        self.signature = tuple(min((a * shingle + b) % _MINHASH_PRIME for shingle in shingles) for a, b in _MINHASH_SEEDS)
+
+    def similarity(self, other):
+        return sum(a == b for a, b in zip(self.signature, other.signature)) / len(self.signature)
+
+    def renaming(self, other):
+        """
+        Compute how the comment of this definition is adapted to another one
+        :param other: The fingerprint of the other definition
+        :return: A dictionary mapping the identifiers of this definition to the ones of the other
+        """
+        if self.digest == other.digest:
+            # the identifiers of exact copies match one to one
+            return {mine: theirs for mine, theirs in zip(self.identifiers, other.identifiers) if mine != theirs}
+        # near copies only share their structure, only their name is replaced
+        if self.name is not None and other.name is not None and self.name != other.name:
+            return {self.name: other.name}
+        return {}
+
+
+def duplicate_groups(fingerprints, threshold):
+    """
+    Group the definitions that are copies of each other
+    :param fingerprints: The fingerprint of each definition
+    :param threshold: The similarity from which two definitions are near copies, above 1 to only group exact copies
+    :return: A list of groups of at least two indices, in the order of the definitions
+    """
+    # exact copies, once the identifiers are numbered
+    parent = list(range(len(fingerprints)))
+
+    def find(i):
+        while parent[i] != i:
+            parent[i] = parent[parent[i]]
+            i = parent[i]
+        return i
+
+    first = {}
+    for i, fingerprint in enumerate(fingerprints):
+        j = first.setdefault(fingerprint.digest, i)
+        if j != i:
+            parent[i] = j
+
+    # near copies, among the first definitions of each exact group, compared when they share a band of their signature
+    if threshold <= 1:
+        buckets = {}
+        for i in first.values():
+            signature = fingerprints[i].signature
+            for band in range(minhash_bands):
+                key = (band, signature[band * minhash_rows:(band + 1) * minhash_rows])
+                for j in buckets.setdefault(key, []):
+                    if find(i) != find(j) and fingerprints[i].similarity(fingerprints[j]) >= threshold:
+                        parent[max(find(i), find(j))] = min(find(i), find(j))
+                buckets[key].append(i)
+
+    groups = {}
+    for i in range(len(fingerprints)):
+        groups.setdefault(find(i), []).append(i)
+    return [group for group in groups.values() if len(group) > 1]
+
+
+def rename_comment(comment, renaming):
+    """
+    Adapt the comment of a definition to a copy of it
+    :param comment: The comment, may be None
+    :param renaming: A dictionary mapping the identifiers to replace to their new name
+    :return: The comment with the identifiers replaced
+    """
+    if comment is None or not renaming:
+        return comment
+    pattern = re.compile(r'\b(?:' + '|'.join(map(re.escape, sorted(renaming, key=len, reverse=True))) + r')\b')
+    return pattern.sub(lambda match: renaming[match.group()], comment)
+
+
+def derive_result(result, renaming):
+    """
+    Derive the result of a copy from the result of its original
+    :param result: The result of the original, as returned by submit_all
+    :param renaming: The identifiers to replace in its comment
+    :return: The result of the copy, in the same form
+    """
+    if not isinstance(result, tuple):
+        return rename_comment(result, renaming)
+    future, position = result
+    derived = Future()
+
+    def on_done(done):
+        try:
+            derived.set_result([rename_comment(done.result()[position], renaming)])
+        except Exception as e:
+            derived.set_exception(e)
+
+    future.add_done_callback(on_done)
+    return derived, 0
+
+
+# requests in flight for any file of the run, by digest of the fingerprint of their definition, so that copies
+# queued later wait for them instead of being sent again
+_in_flight = {}
+_in_flight_lock = threading.Lock()
+
+# number of definitions commented from a copy instead of being sent
+duplicate_stats = {"exact": 0, "near": 0, "in_flight": 0}
+
+
+def _register_in_flight(fingerprint, result):
+    future = result[0]
+    with _in_flight_lock:
+        _in_flight[fingerprint.digest] = (fingerprint, result)
+
+    def forget(_):
+        with _in_flight_lock:
+            if _in_flight.get(fingerprint.digest, (None, None))[1] is result:
+                del _in_flight[fingerprint.digest]
+
+    future.add_done_callback(forget)
+
+
+def submit_all(executor, definitions, allow_network=None, batch_tokens=0, chunk_tokens=2048, on_text=None,
+               use_call_graph=True, deduplicate=True, near_threshold=near_duplicate_threshold):
+    """
+    Queue the requests for all definitions on a pool of workers
+    :param executor: The pool of workers sending the requests, it may be shared by several files
+    :param definitions: The C definitions to comment, a list or a Definitions read on demand
+    :param allow_network: For each definition, whether it may be sent to the model. All of them by default
+    :param batch_tokens: The maximum number of tokens of the definitions packed in one request, 0 to disable batching
+    :param chunk_tokens: Definitions larger than this number of tokens are summarized in parts of this size
+    :param on_text: Called with the index of a definition and the text streamed so far by its single request, may be None
+    :param use_call_graph: Send the functions calling other functions of the file once their callees are
+                           commented, with the summaries of the callees
+    :param deduplicate: Send a single definition of each group of copies, the others share its comment
+    :param near_threshold: The similarity from which two definitions are near copies, above 1 to only merge exact copies
+    :return: For each definition, either its cached comment or a tuple containing a future and the position of the comment in its result
+    """
+    if allow_network is None:
+        allow_network = [True] * len(definitions)
+
+    # serve the cache first, only the misses go to the network
+    results = [cached_comment(definition) for definition in definitions]
+    missing = [i for i, definition in enumerate(definitions) if results[i] is None and allow_network[i]]
+
+    # copies of a definition wait for the result of their original, by index of the original
+    copies = {}
+    fingerprints = None
+    if deduplicate and missing:
+        fingerprints = [Fingerprint(definition) for definition in definitions]
+        to_send = set(missing)
+        for group in duplicate_groups(fingerprints, near_threshold):
+            # a cached definition of the group spares the request
+            sources = [i for i in group if results[i] is not None] or [i for i in group if i in to_send]
+            if not sources:
+                continue
+            for i in group:
+                if i != sources[0] and i in to_send:
+                    copies.setdefault(sources[0], []).append(i)
+                    to_send.discard(i)
+                    exact = fingerprints[i].digest == fingerprints[sources[0]].digest
+                    duplicate_stats["exact" if exact else "near"] += 1
+        # the same definition may already be in flight for another file
+        with _in_flight_lock:
+            for i in sorted(to_send):
+                if fingerprints[i].digest in _in_flight:
+                    fingerprint, result = _in_flight[fingerprints[i].digest]
+                    results[i] = derive_result(result, fingerprint.renaming(fingerprints[i]))
+                    to_send.discard(i)
+                    duplicate_stats["in_flight"] += 1
+        missing = [i for i in missing if i in to_send]
+
+    def share(i, sent=True):
+        # give its result to the copies of a definition, and let the other files wait for it too
+        for copy in copies.pop(i, []):
+            results[copy] = derive_result(results[i], fingerprints[i].renaming(fingerprints[copy]))
+        if sent and fingerprints is not None:
+            _register_in_flight(fingerprints[i], results[i])
+
+    # the originals that are cached, or in flight for another file, are not sent
+    for i in list(copies):
+        if results[i] is not None:
+            share(i, sent=False)
+
+    # large functions are summarized in parts, the others may be batched
+    large = [i for i in missing if count_tokens(definitions[i]) > chunk_tokens and not is_type_definition(definitions[i])]
+    missing = [i for i in missing if i not in large]
+
+    # callers wait for their callees, the leaves of the call graph are sent right away and may be batched
+    graph = {}
+    if use_call_graph:
+        graph = {i: callees for i, callees in call_graph(definitions, missing).items() if callees}
+    leaves = [i for i in missing if i not in graph]
+
+    for i in large:
+        results[i] = (submit_chunked_comment(executor, definitions[i], chunk_tokens), 0)
+        share(i)
+    for batch in make_batches(definitions, leaves, batch_tokens):
+        on_texts = None if on_text is None else [functools.partial(on_text, i) for i in batch]
+        future = executor.submit(_request_definitions, definitions, batch, on_texts)
+        for position, i in enumerate(batch):
+            results[i] = (future, position)
+            share(i)
+
+    # independent callers still run in parallel, each one is queued as soon as its own callees are commented
+    order, graph = dependency_order(graph)
+    for i in order:
+        callees = [(definition_name(definitions[callee]), results[callee]) for callee in graph[i]]
+        results[i] = (submit_with_callees(executor, definitions[i], callees,
+                                          None if on_text is None else functools.partial(on_text, i)), 0)
+        share(i)
+    return results
+
+
+def collect_all(results):
+    """
+    Wait for the results queued by submit_all
+    :param results: The list returned by submit_all
+    :return: An iterator over the descriptions, in the same order as the definitions
+    """
+    # wait for the results in definition order, so the output stays deterministic
+    for result in results:
+        if isinstance(result, tuple):
+            future, position = result
+            yield future.result()[position]
+        else:
+            yield result
+
+
+# hunk header of a unified diff, only the new side is used
+_HUNK_RE = re.compile(r'^@@ -\d+(?:,\d+)? \+(\d+)(?:,(\d+))? @@', re.MULTILINE)
+
+
+def changed_line_ranges(revision_range, path):
+    """
+    List the lines of a file changed in a git revision range
+    :param revision_range: The revision range given to git diff, e.g. HEAD~1..HEAD, or a single revision to compare with the work tree
+    :param path: Path to the file
+    :return: A list of tuples, each containing the first and last changed line (1-based, inclusive) in the new version of the file
+    """
+    directory = os.path.dirname(os.path.abspath(path))
+    diff = subprocess.run(
+        ['git', '-C', directory, 'diff', '--unified=0', '--no-color', '--no-ext-diff', revision_range, '--', os.path.abspath(path)],
+        check=True, capture_output=True, text=True).stdout
+
+    ranges = []
+    for match in _HUNK_RE.finditer(diff):
+        first = int(match.group(1))
+        count = 1 if match.group(2) is None else int(match.group(2))
+        # a pure deletion happens after the given line
+        if count == 0:
+            ranges.append((max(first, 1), max(first, 1)))
+        else:
+            ranges.append((first, first + count - 1))
+    return ranges
+
+
+def line_ranges_to_offsets(content, line_ranges):
+    """
+    Convert line ranges into offset ranges of the content
+    :param content: The content the lines belong to, as bytes or a memory-mapped file
+    :param line_ranges: A list of tuples, each containing a first and last line (1-based, inclusive)
+    :return: A list of tuples, each containing the start and end offset of the lines
+    """
+    # offset of the start of the lines bounding a range, the others are not kept
+    wanted = {line for first, last in line_ranges for line in (first, last + 1)}
+    line_starts = {1: 0}
+    line, line_start = 1, 0
+    for match in re.finditer(b'\n', content):
+        line, line_start = line + 1, match.end()
+        if line in wanted:
+            line_starts[line] = line_start
+    offsets = []
+    for first, last in line_ranges:
+        start = line_starts[first] if first <= line else line_start
+        end = line_starts.get(last + 1, len(content))
+        offsets.append((start, end))
+    return offsets
+
+
+def overlaps(span, ranges):
+    """
+    Check whether a span overlaps any of the given ranges
+    :param span: A tuple containing the start and end index of the span
+    :param ranges: A list of tuples, each containing the start and end index of a range
+    :return: True if the span overlaps at least one range
+    """
+    start, end = span
+    return any(range_start < end and start < range_end for range_start, range_end in ranges)
+
+
+def range_end_revision(revision_range):
+    """
+    Find the revision on the new side of a git revision range
+    :param revision_range: The revision range given to git diff
+    :return: The end revision of the range, or None for a single revision, which git diff compares with the work tree
+    """
+    for separator in ('...', '..'):
+        if separator in revision_range:
+            # an omitted end is HEAD, like for git diff
+            return revision_range.split(separator, 1)[1] or 'HEAD'
+    return None
+
+
+def changed_definitions(revision_range, path, content, spans):
+    """
+    Tell which definitions of a file were changed in a git revision range
+    :param revision_range: The revision range given to git diff, e.g. HEAD~1..HEAD, or a single revision to compare with the work tree
+    :param path: Path to the file
+    :param content: The content of the file in the work tree
+    :param spans: The offsets of the definitions located in the content
+    :return: For each definition, True if it overlaps a changed hunk
+    """
+    line_ranges = changed_line_ranges(revision_range, path)
+    end_revision = range_end_revision(revision_range)
+    if end_revision is None:
+        changed = line_ranges_to_offsets(content, line_ranges)
+        return [overlaps(span, changed) for span in spans]
+
+    # the hunks are lines of the end revision, which the work tree may have moved since: the changed definitions
+    # are located in that revision and matched by their text
+    directory, name = os.path.split(os.path.abspath(path))
+    try:
+        revision_content = subprocess.run(['git', '-C', directory, 'show', f'{end_revision}:./{name}'],
+                                          check=True, capture_output=True).stdout
+    except subprocess.CalledProcessError:
+        # the file does not exist in the end revision, none of its definitions were changed there
+        return [False] * len(spans)
+    changed = line_ranges_to_offsets(revision_content, line_ranges)
+    changed_texts = {revision_content[start:end]
+                     for start, end in locate_all(build_definition_rules(), revision_content, max_size=None)
+                     if overlaps((start, end), changed)}
+    return [bytes(content[start:end]) in changed_texts for start, end in spans]
+
+
+# tokens of the C lexer: comments and literals are matched only to be skipped, directives span their continuation lines.
+# The lookahead lets the regex engine skip quickly to the characters that may start a token.
+# The lexer works on bytes, so that it can scan a memory-mapped file by offset without decoding it.
+_LEX_PATTERN = rb"""
+    (?=[/"'\#%s])
+    (?:
+      (?P<comment>/\*.*?\*/|//[^\n]*)
+    | (?P<literal>"(?:\\.|[^"\\\n])*"|'(?:\\.|[^'\\\n])*')
+    | (?P<directive>\#(?:\\\n|[^\n])*)
+    | (?P<punct>[%s])
+    )"""
+_LEX_RE = re.compile(_LEX_PATTERN % (b'{};', b'{};'), re.VERBOSE | re.DOTALL)
+
+# inside braces the statements don't matter, so the lexer only stops on braces there
+_BODY_LEX_RE = re.compile(_LEX_PATTERN % (b'{}', b'{}'), re.VERBOSE | re.DOTALL)
+
+# name of a preprocessor directive
+_DIRECTIVE_RE = re.compile(rb'#[ \t]*(\w*)')
+
+# comments inside a signature, blanked out before matching it
+_COMMENT_RE = re.compile(rb'/\*.*?\*/|//[^\n]*', re.DOTALL)
+
+# whitespace and comments in front of a definition
+_LEADING_RE = re.compile(rb'(?:\s+|/\*.*?\*/|//[^\n]*)*', re.DOTALL)
+
+# heads of the top-level blocks whose content is itself top-level code
+_TRANSPARENT_RE = re.compile(rb'extern\s*"C"|namespace(?:\s+\w+)?')
+
+
+class BraceScanner:
+    """
+    Brace matcher working on the tokens of the C lexer, so that braces inside comments, string and
+    character literals are ignored. In #if/#elif/#else blocks every branch is scanned, but the brace
+    depth after the block is the one of the first branch, like the compiler would see it if the
+    first branch was taken.
+    """
+
+    def __init__(self, content, depth=0):
+        """
+        :param content: The C code to scan, as bytes or a memory-mapped file
+        :param depth: The brace depth at the position the scan starts from
+        """
+        self.content = content
+        self.depth = depth
+        # for each open conditional, the depth at the #if and the depth at the end of its first branch
+        self.conditionals = []
+
+    def _directive(self, text):
+        name = _DIRECTIVE_RE.match(text).group(1)
+        if name in (b'if', b'ifdef', b'ifndef'):
+            self.conditionals.append([self.depth, None])
+        elif name in (b'elif', b'else') and self.conditionals:
+            conditional = self.conditionals[-1]
+            if conditional[1] is None:
+                conditional[1] = self.depth
+            self.depth = conditional[0]
+        elif name == b'endif' and self.conditionals:
+            depth_at_if, depth_after_first = self.conditionals.pop()
+            if depth_after_first is not None:
+                self.depth = depth_after_first
+
+    def events(self, start=0):
+        """
+        Scan the content from the given index
+        :param start: The index to start from, it must not be inside a comment or a literal
+        :return: An iterator over tuples containing b'{', b'}', b';' or b'#' and the index following the token.
+                 The depth attribute is already updated when a brace is yielded. Semicolons are only
+                 yielded at depth 0.
+        """
+        content = self.content
+        position = start
+        while True:
+            match = (_LEX_RE if self.depth <= 0 else _BODY_LEX_RE).search(content, position)
+            if match is None:
+                return
+            position = match.end()
+            kind = match.lastgroup
+            if kind == 'punct':
+                token = match.group()
+                if token == b'{':
+                    self.depth += 1
+                elif token == b'}':
+                    self.depth -= 1
+                yield token, match.end()
+            elif kind == 'directive':
+                # only a '#' starting a line opens a directive
+                line_start = content.rfind(b'\n', 0, match.start()) + 1
+                if content[line_start:match.start()].strip():
+                    position = match.start() + 1
+                    continue
+                self._directive(match.group())
+                yield b'#', match.end()
+
+
+def _definition_head(content, start, end):
+    """
+    Extract the text that may be the head of a definition
+    :param content: The C code, as bytes or a memory-mapped file
+    :param start: The index the head may start from
+    :param end: The index following the head
+    :return: A tuple containing the index of the head, once the whitespace and comments in front are skipped,
+             and the head, with its comments blanked out without moving the offsets
+    """
+    start = _LEADING_RE.match(content, start, end).end()
+    return start, _COMMENT_RE.sub(lambda m: b' ' * len(m.group()), content[start:end])
+
+
+class FunctionRule:
+    """
+    Recognize the head of a top-level block as a function signature
+    """
+
+    # a function definition ends with its body
+    terminated = False
+
+    def __init__(self):
+        # storage class, qualifiers and return type, then the name and the parameters, which may hold function pointers
+        self.signature = re.compile(rb"""
+            (?:[A-Za-z_]\w*\b\s*(?:[*&]\s*)*)+?
+            \b(?P<name>[A-Za-z_]\w*)\s*
+            \((?:[^()]|\((?:[^()]|\([^()]*\))*\))*\)
+            \s*\Z""", re.VERBOSE)
+        # K&R style: identifiers in the parentheses, declared between the parentheses and the body
+        self.kr_signature = re.compile(rb"""
+            (?:[A-Za-z_]\w*\b\s*(?:\*\s*)*)+?
+            \b(?P<name>[A-Za-z_]\w*)\s*
+            \(\s*\w+(?:\s*,\s*\w+)*\s*\)
+            (?:\s*[A-Za-z_][\w\s*,\[\]]*;)+
+            \s*\Z""", re.VERBOSE)
+        self.keywords = {b'if', b'for', b'while', b'switch', b'return', b'sizeof', b'typedef'}
+        # the head of a struct, union or enum definition, whose attributes may look like parameters. A function
+        # returning a struct goes on with its name and parameters.
+        self.type_head = re.compile(rb"""
+            (?:struct|union|enum)\b
+            (?:\s*(?:[A-Za-z_]\w*\b|__attribute__\s*\(\((?:[^()]|\([^()]*\))*\)\)))*
+            \s*\Z""", re.VERBOSE)
+
+    def _match(self, pattern, content, start, end, search=False):
+        start, head = _definition_head(content, start, end)
+        match = pattern.search(head) if search else pattern.match(head)
+        if match is None or match.group('name') in self.keywords or head.split(None, 1)[0] in self.keywords:
+            return None
+        if self.type_head.match(head, match.start()):
+            return None
+        return start + match.start()
+
+    def match(self, content, hard_start, soft_start, end):
+        """
+        Check whether a top-level block opens a function definition
+        :param content: The C code, as bytes or a memory-mapped file
+        :param hard_start: The index following the last block, directive or start of file
+        :param soft_start: The index following the last top-level statement
+        :param end: The index of the opening brace
+        :return: The start index of the definition, or None if the block is not a function definition
+        """
+        start = self._match(self.signature, content, soft_start, end)
+        if start is not None:
+            return start
+
+        # a macro invocation without semicolon may precede the definition, try from the last blank line
+        paragraph = content.rfind(b'\n\n', soft_start, end)
+        if paragraph >= 0:
+            start = self._match(self.signature, content, paragraph, end)
+            if start is not None:
+                return start
+
+        # the parameters of K&R definitions are declared with statements before the body
+        if soft_start != hard_start:
+            return self._match(self.kr_signature, content, hard_start, end, search=True)
+        return None
+
+    def match_statement(self, content, start, end):
+        # functions are only defined by blocks
+        return None
+
+
+class TypeRule:
+    """
+    Recognize the definitions of types: top-level struct, union and enum blocks, which go on with their
+    declarators up to a semicolon, and typedefs of function pointers. Other typedefs only give a new name
+    to a type and are not worth a comment.
+    """
+
+    # the definition goes on after the closing brace, up to the next top-level semicolon
+    terminated = True
+
+    def __init__(self):
+        # an optional typedef, the keyword, then the tag and the attributes, if any
+        self.record = re.compile(rb"""
+            (?:typedef\s+)?(?:struct|union|enum)\b
+            (?:\s*(?:[A-Za-z_]\w*\b|__attribute__\s*\(\((?:[^()]|\([^()]*\))*\)\)))*
+            \s*\Z""", re.VERBOSE)
+        # the return type, the name between parentheses and the parameters
+        self.function_pointer = re.compile(rb"""
+            typedef\b[^;{}()]*
+            \(\s*\*\s*[A-Za-z_]\w*\s*\)\s*
+            \((?:[^()]|\((?:[^()]|\([^()]*\))*\))*\)
+            \s*;\Z""", re.VERBOSE)
+
+    def match(self, content, hard_start, soft_start, end):
+        """
+        Check whether a top-level block opens a struct, union or enum definition
+        :param content: The C code, as bytes or a memory-mapped file
+        :param hard_start: The index following the last block, directive or start of file
+        :param soft_start: The index following the last top-level statement
+        :param end: The index of the opening brace
+        :return: The start index of the definition, or None if the block is not a type definition
+        """
+        # a macro invocation without semicolon may precede the definition, try from the last blank line too
+        for start in (soft_start, content.rfind(b'\n\n', soft_start, end)):
+            if start < 0:
+                continue
+            start, head = _definition_head(content, start, end)
+            if self.record.match(head):
+                return start
+        return None
+
+    def match_statement(self, content, start, end):
+        """
+        Check whether a top-level statement defines a type
+        :param content: The C code, as bytes or a memory-mapped file
+        :param start: The index following the last top-level statement
+        :param end: The index following the semicolon ending the statement
+        :return: The start index of the definition, or None if the statement is not a type definition
+        """
+        start, head = _definition_head(content, start, end)
+        return start if self.function_pointer.match(head) else None
 
 
 def build_function_definition():
     """
-    Build pyparsing rule for function definition
-    :return: pyparsing rule for function definition
-    """
-    identifier = Word(alphas + nums + '_')
-    type_specifier = Word(alphas + nums + '_')
-    type_qualifier = oneOf('const volatile')
-    storage_class_specifier = oneOf('auto register static extern typedef')
-    function_specifier = oneOf('inline')
-    type_name = (Optional(type_qualifier) + Optional(type_specifier) + ZeroOrMore(type_qualifier))('type_name')
-    declarator = Forward()
-    pointer = Optional(Word('*' + '&'))('pointer')
-    direct_declarator = identifier
-    declarator << (pointer + direct_declarator)
-    parameter_type_list = Forward()
-    param = Group(Optional(type_qualifier)  + Optional(Word("struct")) + Optional(type_specifier) + Optional(declarator))
-    parameter_list = param('parameter') + ZeroOrMore(',' + param)('parameter')
-    parameter_type_list << Group(parameter_list + Optional(',' + '...'))('parameter_type_list') | '...'
-    
-    # return function definition, we used all the above defined rules to define the function definition
-    return  (Optional(storage_class_specifier) + Optional(function_specifier) + type_name + declarator + '(' + Optional(parameter_type_list)  + ')' + '{')
-    
-# define C language syntax for pyparsing
+    Build rule for function definition
+    :return: rule for function definition
+    """
+    return FunctionRule()
+
+
+def build_definition_rules():
+    """
+    Build the rules of every kind of definition to comment
+    :return: A list of rules, tried in order on each top-level block and statement
+    """
+    return [build_function_definition(), TypeRule()]
 
 
 def find_end(content, start):
     """
     Find the end of a C function or struct definition
-    :param content: The C code to search
-    :param start: The starting index in the content where the function or struct definition begins
-     :return: The index of the end of the function or struct definition
-    """
-    # Initialize a stack to keep track of curly braces
-    brace_stack = ['{']
-    # Iterate over the characters in the function
-    for i, c in enumerate(content[start:]):
-        # If we encounter an open curly brace, push it onto the stack
-        if c == '{':
-            brace_stack.append(c)
-        # If we encounter a close curly brace, pop the top element from the stack
-        elif c == '}':
-            brace_stack.pop()
-        # If the stack is empty, we have reached the end of the function
-        if len(brace_stack) == 0:
-            break
+    :param content: The C code to search, as bytes or a memory-mapped file
+    :param start: The index in the content just after the opening brace of the definition
+    :return: The index of the end of the function or struct definition
+    """
+    # the opening brace has already been consumed
+    scanner = BraceScanner(content, depth=1)
+    for token, offset in scanner.events(start):
+        # if the depth reaches zero, we have reached the end of the function
+        if token == b'}' and scanner.depth == 0:
+            return offset
+
+    return len(content)
 
-    return start + i + 1
 
-def locate_all(definition, content):
+def locate_all(rules, content, max_size=4000, signature_window=2048):
     """
-    Locate all instances of a C definition in a given content
-    :param definition: The pyparsing definition of the function or struct to search for
-    :param content: The C code to search
-    :return: A list of tuples, each containing the start and end index of a function or struct definition
+    Locate all definitions in a given content, in a single pass over the tokens of the buffer
+    :param rules: The rules recognizing the definitions to search for, see build_definition_rules
+    :param content: The C code to search, as bytes or a memory-mapped file
+    :param max_size: Definitions larger than this number of bytes are skipped, None to keep all of them
+    :param signature_window: Maximum number of bytes in front of a block that may belong to its signature
+    :return: A list of tuples, each containing the start and end offset of a definition, in the order of the content
     """
     content_located = []
-    
-    # search for function or struct definitions in the content
-    while len(content) > 10:
-        definition= locatedExpr(definition)
-        try:
-            result = definition.parseString(content)[0]
-        except Exception:
-            # if a function or struct definition is not found, move on to the next block of code
-            offset = content.find('\n\n') + 1
-            content = content[offset:]
-            continue
-
-        start_off = result.locn_start
 
-        end_off = find_end(content, result.locn_end + 30)
+    def add(start, end):
         # skip function or struct definitions that are too large
-        if end_off - start_off > 4000:
-            offset = content.find('\n\n') + 1
-            content = content[offset:]
-            continue
+        if max_size is None or end - start <= max_size:
+            content_located.append((start, end))
+
+    scanner = BraceScanner(content)
+    # starts of the text that may hold the head of the next block
+    hard_start = soft_start = 0
+    # start of the definition whose body is being scanned, and the rule that recognized it
+    definition_start = definition_rule = None
+    # start of the type definition waiting for the semicolon after its body
+    declarators_start = None
+    # number of open extern "C" and namespace blocks
+    transparent = 0
 
-        content_located.append(content[start_off:end_off])
-        offset = end_off + 1
-        content = content[offset:]
+    for token, offset in scanner.events():
+        if token == b'{':
+            if scanner.depth != 1 or declarators_start is not None:
+                # nested blocks, or the initializer of a variable declared with a type definition
+                continue
+            brace = offset - 1
+            hard_start = max(hard_start, brace - signature_window)
+            soft_start = max(soft_start, hard_start)
+            if _TRANSPARENT_RE.fullmatch(content[soft_start:brace].strip()):
+                # the content of extern "C" and namespace blocks is top-level code
+                scanner.depth = 0
+                transparent += 1
+                hard_start = soft_start = offset
+                continue
+            for definition_rule in rules:
+                definition_start = definition_rule.match(content, hard_start, soft_start, brace)
+                if definition_start is not None:
+                    break
+        elif token == b'}':
+            if scanner.depth > 0 or (scanner.depth == 0 and declarators_start is not None):
+                continue
+            if scanner.depth < 0:
+                # end of an extern "C" or namespace block, or an unbalanced brace
+                scanner.depth = 0
+                transparent = max(0, transparent - 1)
+            elif definition_start is not None:
+                if definition_rule.terminated:
+                    # the declarators of the type follow its body
+                    declarators_start = definition_start
+                else:
+                    add(definition_start, offset)
+                definition_start = None
+            hard_start = soft_start = offset
+        elif token == b';':
+            if scanner.depth != 0:
+                continue
+            if declarators_start is not None:
+                add(declarators_start, offset)
+                declarators_start = None
+                hard_start = offset
+            else:
+                for rule in rules:
+                    statement_start = rule.match_statement(content, soft_start, offset)
+                    if statement_start is not None:
+                        add(statement_start, offset)
+                        break
+            soft_start = offset
+        elif scanner.depth == 0:
+            hard_start = soft_start = offset
     return content_located
 
+
+def splice_comments(output, content, comments):
+    """
+    Write the content with the comments inserted, in a single pass
+    :param output: The binary file to write to
+    :param content: The original C code, as bytes or a memory-mapped file
+    :param comments: A dictionary mapping the start offset of a definition to its comment
+    """
+    # the content is written through a view, so that it is not copied
+    with memoryview(content) as view:
+        previous = 0
+        for start in sorted(comments):
+            output.write(view[previous:start])
+            output.write(comments[start].encode('utf-8'))
+            previous = start
+        output.write(view[previous:])
+
+
+# inputs of at least this number of bytes are memory-mapped instead of being read in memory
+mmap_threshold = 1 << 20
+
+
+def open_input(path):
+    """
+    Open a C file for the locator, which works on its bytes by offset
+    :param path: Path to the C file
+    :return: The content of the file as bytes, or a read-only memory-mapped file if it is large
+    """
+    with open(path, 'rb') as f:
+        if os.fstat(f.fileno()).st_size < mmap_threshold:
+            return f.read()
+        # the pages are loaded on demand and may be dropped by the system, whatever the size of the file
+        return mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+
+
+def close_input(content):
+    """
+    Release the content returned by open_input
+    """
+    if isinstance(content, mmap.mmap):
+        content.close()
+
+
+class Definitions:
+    """
+    The definitions of an input, by offset in its content. The text of a definition is decoded each
+    time it is accessed and is not kept, so the input never needs to be in memory as a whole.
+    """
+
+    def __init__(self, content, spans):
+        """
+        :param content: The C code, as bytes or a memory-mapped file
+        :param spans: A list of tuples, each containing the start and end offset of a definition
+        """
+        self.content = content
+        self.spans = spans
+
+    def __len__(self):
+        return len(self.spans)
+
+    def __getitem__(self, index):
+        start, end = self.spans[index]
+        return self.content[start:end].decode('utf-8', errors='replace')
+
+    def __iter__(self):
+        return (self[i] for i in range(len(self)))
+
+
+class OutputWriter:
+    """
+    Collect the generated comments of one input, record them in an append-only journal and
+    periodically checkpoint the spliced output with an atomic rename
+    """
+
+    def __init__(self, output_file, content, checkpoint_every=10, partial_interval=1.0):
+        """
+        :param output_file: Path to the output file
+        :param content: The original C code, as bytes or a memory-mapped file
+        :param checkpoint_every: Number of comments between two checkpoints of the output file
+        :param partial_interval: Minimum number of seconds between two journaled partial comments of a definition
+        """
+        self.output_file = output_file
+        self.content = content
+        self.checkpoint_every = checkpoint_every
+        self.partial_interval = partial_interval
+        self.comments = {}
+        self.pending = 0
+        self.partials = {}
+        # the partial comments are journaled by the workers
+        self.lock = threading.Lock()
+
+        # the journal only applies to the exact same input, the definitions are identified by byte offset
+        self.journal_path = output_file + '.journal'
+        self.header = {"input": hashlib.sha256(content).hexdigest(), "offsets": "bytes"}
+        self._replay(self.header)
+        # opened with the first record, so that a queued file holds no file descriptor for its journal
+        self.journal = None
+        self.released = False
+
+    def _replay(self, header):
+        """
+        Recover the comments of a previous interrupted run on the same input
+        """
+        if not os.path.exists(self.journal_path):
+            return
+        with open(self.journal_path, 'r') as f:
+            lines = f.read().splitlines()
+        try:
+            records = [json.loads(line) for line in lines if line]
+        except ValueError:
+            # the last record of a crashed run may be truncated
+            records = []
+            for line in lines:
+                try:
+                    records.append(json.loads(line))
+                except ValueError:
+                    break
+        if not records or records[0] != header:
+            # stale journal of another input, start over
+            os.remove(self.journal_path)
+            return
+        # partial comments of streamed completions are not reused
+        for record in records[1:]:
+            if "comment" in record:
+                self.comments[record["start"]] = record["comment"]
+
+    def _append(self, record):
+        with self.lock:
+            # a late partial comment of a released writer is dropped
+            if self.released:
+                return
+            if self.journal is None:
+                self.journal = open(self.journal_path, 'a')
+                if self.journal.tell() == 0:
+                    self.journal.write(json.dumps(self.header) + "\n")
+            self.journal.write(json.dumps(record) + "\n")
+            self.journal.flush()
+
+    def add_partial(self, start, text):
+        """
+        Journal the text streamed so far for the definition starting at the given index
+        :param start: The start offset of the definition in the original content
+        :param text: The text generated so far
+        """
+        now = time.monotonic()
+        with self.lock:
+            if now - self.partials.get(start, 0.0) < self.partial_interval:
+                return
+            self.partials[start] = now
+        self._append({"start": start, "partial": text})
+
+    def add(self, start, comment):
+        """
+        Record the comment of the definition starting at the given index
+        :param start: The start offset of the definition in the original content
+        :param comment: The comment to insert in front of the definition
+        """
+        self.comments[start] = comment
+        self._append({"start": start, "comment": comment})
+        self.pending += 1
+        if self.pending >= self.checkpoint_every:
+            self.checkpoint()
+
+    def checkpoint(self):
+        """
+        Atomically replace the output file with the content commented so far
+        """
+        temporary = self.output_file + '.tmp'
+        with open(temporary, 'wb') as f:
+            splice_comments(f, self.content, self.comments)
+        os.replace(temporary, self.output_file)
+        self.pending = 0
+
+    def close(self):
+        """
+        Write the final output, drop the journal and release the input
+        """
+        self.checkpoint()
+        self.release()
+        if os.path.exists(self.journal_path):
+            os.remove(self.journal_path)
+
+    def release(self):
+        """
+        Close the journal and release the input without writing the output, the journal is kept for the next run
+        """
+        with self.lock:
+            self.released = True
+            if self.journal is not None:
+                self.journal.close()
+                self.journal = None
+        close_input(self.content)
+
+
+class CommentIndex:
+    """
+    Sidecar index of the generated comments, written along the outputs: a JSONL file with one record per
+    comment, and a hash table mapping the symbols to the offset of their record, meant to be memory-mapped.
+
+    The table file starts with the magic b'PACIDX01' and the number of slots, a power of two, as a little-endian
+    64-bit integer. Each slot holds two little-endian 64-bit integers: the FNV-1a hash of the UTF-8 symbol (0 marks
+    an empty slot, a symbol hashing to 0 uses 1) and the offset of the record in the JSONL file. A lookup starts at the
+    slot of the hash modulo the number of slots and goes on with the next ones until an empty slot, since static
+    functions of different files may share a name.
+    """
+
+    magic = b'PACIDX01'
+
+    def __init__(self, path):
+        """
+        :param path: Path to the JSONL file, the table is written next to it with the .idx suffix
+        """
+        self.path = path
+        self.file = open(path, 'wb')
+        # hash of the symbol and offset of each record
+        self.symbols = []
+        self.records = 0
+
+    @staticmethod
+    def symbol_hash(symbol):
+        """
+        :param symbol: The name of a function or type
+        :return: The 64-bit FNV-1a hash of its UTF-8 encoding, never 0
+        """
+        value = 0xcbf29ce484222325
+        for byte in symbol.encode('utf-8'):
+            value = ((value ^ byte) * 0x100000001b3) & 0xffffffffffffffff
+        return value or 1
+
+    def add_file(self, input_file, output_file, definitions, comments):
+        """
+        Add the records of the comments of a file
+        :param input_file: Path to the input file
+        :param output_file: Path to the output file
+        :param definitions: The Definitions of the input file
+        :param comments: A dictionary mapping the start offset of a definition to its comment
+        """
+        # bytes inserted in front of the current definition of the output
+        shift = 0
+        for i, (start, end) in enumerate(definitions.spans):
+            comment = comments.get(start)
+            if comment is None:
+                continue
+            definition = definitions[i]
+            inserted = len(comment.encode('utf-8'))
+            record = {
+                "file": output_file,
+                "source": input_file,
+                "symbol": symbol_name(definition),
+                "kind": "type" if is_type_definition(definition) else "function",
+                "comment_start": start + shift,
+                "start": start + shift + inserted,
+                "end": end + shift + inserted,
+                "input_start": start,
+                "input_end": end,
+                "hash": hashlib.sha256(definitions.content[start:end]).hexdigest(),
+                "comment": " ".join(line.strip().lstrip('/').strip() for line in comment.splitlines() if line.strip()),
+            }
+            shift += inserted
+            offset = self.file.tell()
+            self.file.write(json.dumps(record).encode('utf-8') + b"\n")
+            self.records += 1
+            if record["symbol"] is not None:
+                self.symbols.append((self.symbol_hash(record["symbol"]), offset))
+
+    def close(self):
+        """
+        Write the hash table of the symbols and close the JSONL file
+        """
+        self.file.close()
+        # at most half of the slots are used, so the probes stay short
+        slots = 1
+        while slots < 2 * len(self.symbols):
+            slots *= 2
+        table = [(0, 0)] * slots
+        for value, offset in self.symbols:
+            slot = value % slots
+            while table[slot][0] != 0:
+                slot = (slot + 1) % slots
+            table[slot] = (value, offset)
+        temporary = self.path + '.idx.tmp'
+        with open(temporary, 'wb') as f:
+            f.write(self.magic + struct.pack('<Q', slots))
+            for value, offset in table:
+                f.write(struct.pack('<QQ', value, offset))
+        os.replace(temporary, self.path + '.idx')
+
+
+def lookup_comment(index_path, symbol):
+    """
+    Look up the records of a symbol in an index written by CommentIndex, without reading the whole index
+    :param index_path: Path to the JSONL file of the index
+    :param symbol: The name of a function or type
+    :return: The list of records of the symbol, one per file defining it
+    """
+    value = CommentIndex.symbol_hash(symbol)
+    records = []
+    with open(index_path + '.idx', 'rb') as f, mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as table, \
+            open(index_path, 'rb') as jsonl:
+        if table[:8] != CommentIndex.magic:
+            raise ValueError(f"{index_path}.idx is not an index of comments")
+        slots, = struct.unpack_from('<Q', table, 8)
+        slot = value % slots
+        while True:
+            slot_value, offset = struct.unpack_from('<QQ', table, 16 + 16 * slot)
+            if slot_value == 0:
+                return records
+            if slot_value == value:
+                jsonl.seek(offset)
+                record = json.loads(jsonl.readline())
+                if record["symbol"] == symbol:
+                    records.append(record)
+            slot = (slot + 1) % slots
+
+
+# grammar of the parse worker processes, built once per process
+_worker_grammar = None
+
+
+def _init_parse_worker():
+    global _worker_grammar
+    _worker_grammar = build_definition_rules()
+
+
+def parse_file(path):
+    """
+    Locate the definitions of a file, run in the parse worker processes
+    :param path: Path to the C file
+    :return: A list of tuples, each containing the start and end offset of a definition
+    """
+    content = open_input(path)
+    try:
+        # large definitions are kept, the token budget of the model decides what can be sent
+        return locate_all(_worker_grammar, content, max_size=None)
+    finally:
+        close_input(content)
+
+
+def list_input_files(input_path, output_path, pattern):
+    """
+    List the files to comment and where to write them
+    :param input_path: A file, a directory searched recursively, or a glob pattern
+    :param output_path: The output file, or the output directory when several files are commented
+    :param pattern: The file name pattern used when input_path is a directory
+    :return: A list of tuples, each containing an input file and its output file
+    """
+    if os.path.isfile(input_path):
+        return [(input_path, output_path)]
+
+    if os.path.isdir(input_path):
+        root = input_path
+        paths = [os.path.join(directory, name)
+                 for directory, _, names in os.walk(input_path)
+                 for name in fnmatch.filter(names, pattern)]
+    else:
+        paths = [path for path in glob.glob(input_path, recursive=True) if os.path.isfile(path)]
+        root = os.path.commonpath([os.path.dirname(os.path.abspath(path)) for path in paths]) if paths else '.'
+
+    # the tree under the input root is mirrored under the output directory
+    return [(path, os.path.join(output_path, os.path.relpath(os.path.abspath(path), os.path.abspath(root))))
+            for path in sorted(paths)]
+
+
+def start_file(executor, input_file, output_file, spans, args):
+    """
+    Read a file, recover its journal and queue the requests of its definitions
+    :param executor: The pool of workers sending the requests, shared by all files
+    :param input_file: Path to the input file
+    :param output_file: Path to the output file
+    :param spans: The offsets of the definitions located in the input file
+    :param args: The command line arguments
+    :return: A tuple containing the writer, the definitions, the indices of the definitions to comment and their queued results
+    """
+    # open the input file, large files are memory-mapped
+    content = open_input(input_file)
+    writer = None
+    try:
+        # the text of the definitions is only materialized when they are sent or printed
+        definitions = Definitions(content, spans)
+
+        # in incremental mode, only the definitions overlapping a changed hunk may go to the network
+        allow_network = None
+        if args.git_range is not None:
+            allow_network = changed_definitions(args.git_range, input_file, content, spans)
+            print(f"{input_file}: {sum(allow_network)} of {len(definitions)} definitions changed in {args.git_range}")
+
+        # comments of an interrupted run on the same input are recovered from the journal
+        output_directory = os.path.dirname(output_file)
+        if output_directory:
+            os.makedirs(output_directory, exist_ok=True)
+        writer = OutputWriter(output_file, content, args.checkpoint_every)
+        todo = [i for i, (start, end) in enumerate(spans) if start not in writer.comments]
+        if len(todo) != len(spans):
+            print(f"{input_file}: recovered {len(spans) - len(todo)} comments from {writer.journal_path}")
+        if allow_network is not None:
+            allow_network = [allow_network[i] for i in todo]
+
+        # streamed text is journaled while it arrives
+        def on_text(k, text):
+            writer.add_partial(spans[todo[k]][0], text)
+
+        results = submit_all(executor, Definitions(content, [spans[i] for i in todo]), allow_network, args.batch_tokens,
+                             args.chunk_tokens, on_text, not args.no_call_graph, not args.no_dedup, args.near_duplicates)
+        return writer, definitions, todo, results
+    except BaseException:
+        # nothing will finish the file, its journal is kept for the next run
+        if writer is not None:
+            writer.release()
+        else:
+            close_input(content)
+        raise
+
+
+def finish_file(writer, definitions, todo, results, spans, verbose, index=None, input_file=None):
+    """
+    Wait for the comments of a file and write its output
+    :param writer: The writer of the output file
+    :param definitions: The definitions of the file
+    :param todo: The indices of the definitions that were queued
+    :param results: The results queued by submit_all
+    :param spans: The offsets of the definitions
+    :param verbose: Print every comment with its definition
+    :param index: The CommentIndex to add the comments of the file to, may be None
+    :param input_file: Path to the input file, recorded in the index
+    :return: The number of commented definitions
+    """
+    try:
+        # comment each definition, the requests run in parallel but come back in order
+        commented = len(spans) - len(todo)
+        for i, description in zip(todo, collect_all(results)):
+            # definitions without a comment available are left untouched
+            if description is not None:
+                commented += 1
+                writer.add(spans[i][0], description)
+                if verbose:
+                    definition = definitions[i]
+                    print(description + definition)
+                    spent = token_usage.spent(definition)
+                    if spent is not None:
+                        prompt_tokens, completion_tokens = spent
+                        print(f"[{prompt_tokens} prompt tokens, {completion_tokens} completion tokens]")
+
+        # index the comments, the input is released when the output is written
+        if index is not None:
+            index.add_file(input_file, writer.output_file, definitions, writer.comments)
+    except BaseException:
+        # the comments written so far stay in the journal for the next run
+        writer.release()
+        raise
+
+    # write the commented definitions to the output file
+    writer.close()
+    return commented
+
+
+def _file_state(path):
+    # a file is considered changed when its size or modification time changes
+    with contextlib.suppress(OSError):
+        stat = os.stat(path)
+        return stat.st_mtime_ns, stat.st_size
+    return None
+
+
+def watch_files(executor, args, interval=0.2):
+    """
+    Comment the input files again each time they are saved, until interrupted. The workers, the rules of
+    the locator, the cache and the connections of the workers stay warm between two saves, and the
+    unchanged definitions are served by the cache, so only the changed ones are sent.
+    :param executor: The pool of workers sending the requests
+    :param args: The command line arguments
+    :param interval: Seconds between two scans of the input files
+    """
+    _init_parse_worker()
+    files = list_input_files(args.input_file, args.output_file, args.pattern)
+    states = {input_file: _file_state(input_file) for input_file, _ in files}
+    # a file is commented once it stops changing, so a save in progress is not sent
+    changed = {}
+    print(f"Watching {len(files)} files, press Ctrl+C to stop")
+    try:
+        while circuit_breaker.reason is None:
+            time.sleep(interval)
+            files = list_input_files(args.input_file, args.output_file, args.pattern)
+            outputs = {os.path.abspath(output_file) for _, output_file in files}
+            for input_file, output_file in files:
+                # the outputs may be written under the watched directory
+                if os.path.abspath(input_file) in outputs:
+                    continue
+                state = _file_state(input_file)
+                if state == states.get(input_file):
+                    changed.pop(input_file, None)
+                    continue
+                if changed.get(input_file) != state:
+                    changed[input_file] = state
+                    continue
+                del changed[input_file]
+                states[input_file] = state
+
+                started = time.monotonic()
+                misses = 0 if comment_cache is None else comment_cache.misses
+                try:
+                    spans = parse_file(input_file)
+                    commented = finish_file(*start_file(executor, input_file, output_file, spans, args), spans, verbose=False)
+                except Exception as e:
+                    print(f"{input_file}: error: {e}")
+                    continue
+                sent = 0 if comment_cache is None else comment_cache.misses - misses
+                print(f"{input_file}: commented {commented} of {len(spans)} definitions, {sent} sent, "
+                      f"in {time.monotonic() - started:.1f} seconds")
+    except KeyboardInterrupt:
+        pass
+
+
 def main():
     # parse command line arguments
     parser = argparse.ArgumentParser()
-    parser.add_argument('input_file', help='Path to the input file')
-    parser.add_argument('output_file', help='Path to the output file')
+    parser.add_argument('input_file', help='Path to the input file, or a directory or glob pattern to comment several files')
+    parser.add_argument('output_file', help='Path to the output file, or the output directory when commenting several files')
     parser.add_argument('--api_key', help='OpenAI API key')
     parser.add_argument('--free', action='store_true', help='Use of free OpenAI API version ( limited in tokens per minute). So it will slow down the process.')
+    parser.add_argument('--concurrency', type=int, default=4, help='Maximum number of requests sent in parallel')
+    parser.add_argument('--rpm', type=int, help='Requests per minute allowed by the account (0 for no limit)')
+    parser.add_argument('--tpm', type=int, help='Tokens per minute allowed by the account (0 for no limit)')
+    parser.add_argument('--cache', default='.pleaseAddComment.cache', help='Path to the cache of generated comments')
+    parser.add_argument('--no_cache', action='store_true', help='Always query the model, do not read or write the cache')
+    parser.add_argument('--git_range', help='Only send the functions changed in this git revision range (e.g. HEAD~1..HEAD), the others reuse the cached comments')
+    parser.add_argument('--batch_tokens', type=int, default=2000, help='Pack small functions into one request up to this number of tokens (0 to disable)')
+    parser.add_argument('--chunk_tokens', type=int, default=2048, help='Functions larger than this number of tokens are summarized in parts, then merged')
+    parser.add_argument('--checkpoint_every', type=int, default=10, help='Number of comments between two rewrites of the output file')
+    parser.add_argument('--pattern', default='*.c', help='File name pattern of the files to comment when the input is a directory')
+    parser.add_argument('--no_stream', action='store_true', help='Wait for complete answers instead of streaming them')
+    parser.add_argument('--timeout', type=float, default=60, help='Seconds after which a request is cancelled')
+    parser.add_argument('--first_token_timeout', type=float, default=20, help='Seconds to wait for the first token of an answer')
+    parser.add_argument('--report', help='Write a JSON report of the run, with the latency histograms of the requests, to this path')
+    parser.add_argument('--jobs', type=int, default=os.cpu_count(), help='Number of processes parsing files when commenting several files')
+    parser.add_argument('--max_open_files', type=int, default=64, help='Maximum number of files whose requests are in flight at once when commenting several files')
+    parser.add_argument('--watch', action='store_true', help='Keep running and comment the input files again each time they are saved')
+    parser.add_argument('--watch_interval', type=float, default=0.2, help='Seconds between two checks of the watched files')
+    parser.add_argument('--index', help='Also write the comments to this JSONL file, with a hash table of the symbols in <index>.idx (first pass only with --watch)')
+    parser.add_argument('--no_dedup', action='store_true', help='Send every definition, even the copies of another one')
+    parser.add_argument('--near_duplicates', type=float, default=near_duplicate_threshold, help='Similarity from which two definitions share a comment, above 1 to only merge exact copies (renamed identifiers aside)')
+    parser.add_argument('--no_call_graph', action='store_true', help='Send every function right away, without waiting for the summaries of the functions it calls')
+    parser.add_argument('--local_url', help='Send the requests to a self-hosted OpenAI compatible server instead, e.g. http://localhost:8000/v1')
+    parser.add_argument('--local_model', help='Name of the model served by the local server')
+    parser.add_argument('--local_batch_size', type=int, default=32, help='Maximum number of prompts batched into one request to the local server')
+    parser.add_argument('--local_batch_window', type=float, default=0.02, help='Seconds to wait for more prompts before sending a batch to the local server')
     args = parser.parse_args()
+    if args.local_url is not None and args.local_model is None:
+        parser.error('--local_model is required with --local_url')
     
     # set OpenAI API key
     openai.api_key = args.api_key
@@ -156,38 +2516,140 @@ def main():
     # set OpenAI API version
     openai_free_version = args.free
 
-    # read the input file
-    with open(args.input_file, 'r') as f:
-        content = f.read()
-        
-    function_definition = build_function_definition()
+    # size the rate limiter to the account quotas, the free version has its own defaults
+    global rate_limiter
+    requests_per_minute = args.rpm
+    tokens_per_minute = args.tpm
+    if openai_free_version:
+        requests_per_minute = free_requests_per_minute if requests_per_minute is None else requests_per_minute
+        tokens_per_minute = free_tokens_per_minute if tokens_per_minute is None else tokens_per_minute
+    rate_limiter = RateLimiter(requests_per_minute or 0, tokens_per_minute or 0)
 
-    # locate all function definitions in the input file
-    functions = locate_all(function_definition, content)
-    
-    # in a future version, we could also add support for struct definitions
-    # skip
-
-    # create a list of all definitions to comment
-    definitions = functions 
-
-    # comment each definition
-    for definition in definitions:
-        # send definition to OpenAI API
-        description = query_func_model(definition)
-        replace = description + definition
-        content = content.replace(definition, replace) 
-        print(replace)
-        
-        # write refactored definitions to the output file in real time
-        with open(args.output_file, 'w') as f:
-            f.write(content)
-        
-
-        if openai_free_version:
-            print("Sleeping for 15 seconds to avoid hitting the free API limit")
-            time.sleep(15)
+    # send the requests to a self-hosted model, its name is part of the cache key
+    global backend
+    if args.local_url is not None:
+        model_parameters["model"] = args.local_model
+        backend = LocalBackend(args.local_url, args.local_model, args.local_batch_size, args.local_batch_window,
+                               api_key=args.api_key or "local")
+
+    # configure the requests
+    global stream_completions, request_timeout, first_token_timeout
+    stream_completions = not args.no_stream
+    request_timeout = args.timeout
+    first_token_timeout = args.first_token_timeout
+
+    # open the cache of generated comments
+    global comment_cache
+    if not args.no_cache:
+        comment_cache = CommentCache(args.cache)
+    elif args.watch:
+        # the unchanged definitions of a saved file must still not be sent again
+        comment_cache = CommentCache(':memory:')
+
+    files = list_input_files(args.input_file, args.output_file, args.pattern)
+    single_file = os.path.isfile(args.input_file)
+
+    # the sidecar index covers every file of the run
+    comment_index = None if args.index is None else CommentIndex(args.index)
+
+    # every file shares the same pool of workers, so the rate limiter and the concurrency apply to the whole run
+    total_definitions = total_commented = 0
+    failed = []
+    with ThreadPoolExecutor(max_workers=max(1, args.concurrency)) as executor:
+        if single_file:
+            _init_parse_worker()
+            parsed = [((args.input_file, args.output_file), parse_file(args.input_file))]
+            parse_pool = None
+        else:
+            # parsing is CPU bound, so it runs in processes pulling the files from a shared queue
+            parse_pool = ProcessPoolExecutor(max_workers=max(1, args.jobs), initializer=_init_parse_worker)
+            futures = {parse_pool.submit(parse_file, input_file): (input_file, output_file)
+                       for input_file, output_file in files}
+            parsed = ((futures[future], future) for future in as_completed(futures))
+
+        # queue the requests of each file as soon as it is parsed, but only keep --max_open_files files in flight:
+        # each one holds its input, its journal and its results until its output is written
+        started = deque()
+        finished = 0
+
+        def finish_oldest():
+            nonlocal finished, total_definitions, total_commented
+            input_file, spans, job = started.popleft()
+            finished += 1
+            try:
+                commented = finish_file(*job, spans, verbose=single_file, index=comment_index, input_file=input_file)
+            except Exception as e:
+                print(f"[{finished}/{len(files)}] {input_file}: error: {e}")
+                failed.append(input_file)
+                return
+            total_definitions += len(spans)
+            total_commented += commented
+            if not single_file:
+                print(f"[{finished}/{len(files)}] {input_file}: commented {commented} of {len(spans)} definitions")
+
+        for (input_file, output_file), spans in parsed:
+            try:
+                if isinstance(spans, Future):
+                    spans = spans.result()
+                started.append((input_file, spans, start_file(executor, input_file, output_file, spans, args)))
+            except Exception as e:
+                finished += 1
+                print(f"[{finished}/{len(files)}] {input_file}: error: {e}")
+                failed.append(input_file)
+            # the requests of the oldest file were queued first, so it is the first one expected to be done
+            while len(started) >= max(1, args.max_open_files):
+                finish_oldest()
+        if parse_pool is not None:
+            parse_pool.shutdown()
+
+        # write the outputs of the files still in flight
+        while started:
+            finish_oldest()
+
+        # stay up and comment the files again when they are saved
+        if args.watch:
+            watch_files(executor, args, args.watch_interval)
+
+    if comment_index is not None:
+        comment_index.close()
+        print(f"Index: {comment_index.records} comments in {args.index}")
+
+    # print the run summary
+    if not single_file:
+        print(f"Files: {len(files) - len(failed)} commented, {len(failed)} failed")
+    print(f"Commented {total_commented} of {total_definitions} definitions")
+    print(f"Tokens: {token_usage.prompt} prompt, {token_usage.completion} completion")
+    if any(duplicate_stats.values()):
+        print(f"Duplicates: {duplicate_stats['exact']} exact and {duplicate_stats['near']} near copies, "
+              f"{duplicate_stats['in_flight']} already in flight, not sent")
+    if comment_cache is not None:
+        print(f"Cache: {comment_cache.hits} hits, {comment_cache.misses} misses")
+        comment_cache.close()
+    if circuit_breaker.reason is not None:
+        print(f"Requests stopped: {circuit_breaker.reason}")
+    if isinstance(backend, LocalBackend):
+        print(f"Local server: {backend.batches} batched requests")
+
+    # write the machine-readable report
+    if args.report is not None:
+        report = {
+            "files": len(files),
+            "failed": failed,
+            "definitions": total_definitions,
+            "commented": total_commented,
+            "tokens": {"prompt": token_usage.prompt, "completion": token_usage.completion},
+            "duplicates": duplicate_stats,
+            "cache": None if comment_cache is None else {"hits": comment_cache.hits, "misses": comment_cache.misses},
+            "requests": request_metrics.to_dict(),
+            "stopped": circuit_breaker.reason,
+            "local_batches": backend.batches if isinstance(backend, LocalBackend) else None,
+        }
+        with open(args.report, 'w') as f:
+            json.dump(report, f, indent=2)
+
+    if failed or circuit_breaker.reason is not None:
+        sys.exit(1)
     
 
 if __name__ == '__main__':
-    main()
\ No newline at end of file
+    main()